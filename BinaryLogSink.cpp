@@ -0,0 +1,510 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "BinaryLogSink.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sstream>
+
+using namespace std;
+
+namespace neosmart
+{
+	using namespace BinaryLog;
+
+	static const char segmentMagic[8] = "NSTBLG2";
+
+	BinaryLogSink::BinaryLogSink(const char *path, uint32_t segmentRecords, uint32_t indexInterval)
+		: _segmentStart(0), _written(0), _lastTimestamp(0), _segmentRecords(max<uint32_t>(segmentRecords, 1)), _indexInterval(max<uint32_t>(indexInterval, 1)), _errors(0), _lastError(0)
+	{
+		_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (_fd < 0)
+			return;
+
+		off_t end = lseek(_fd, 0, SEEK_END);
+		_written = end > 0 ? (uint64_t) end : 0;
+		_buffer.reserve(64 * 1024);
+		OpenSegment();
+	}
+
+	BinaryLogSink::~BinaryLogSink()
+	{
+		if (_fd < 0)
+			return;
+
+		CloseSegment();
+		close(_fd);
+	}
+
+	//Must be called with _lock held
+	void BinaryLogSink::OpenSegment()
+	{
+		memset(&_segment, 0, sizeof(_segment));
+		memcpy(_segment.magic, segmentMagic, sizeof(segmentMagic));
+		_segment.minTime = UINT64_MAX;
+		_segmentStart = _written + _buffer.size();
+		_index.clear();
+		_sites.clear();
+		_defined.clear();
+
+		//Written with zero sizes for now; CloseSegment() fills them in
+		const char *header = (const char *) &_segment;
+		_buffer.insert(_buffer.end(), header, header + sizeof(_segment));
+	}
+
+	//Must be called with _lock held
+	void BinaryLogSink::CloseSegment()
+	{
+		_segment.indexCount = (uint32_t) _index.size();
+		const char *index = (const char *) _index.data();
+		_buffer.insert(_buffer.end(), index, index + _index.size() * sizeof(IndexEntry));
+		_segment.siteCount = (uint32_t) _sites.size();
+		const char *sites = (const char *) _sites.data();
+		_buffer.insert(_buffer.end(), sites, sites + _sites.size() * sizeof(uint64_t));
+		//A segment missing some of its data keeps the zero sizes it was opened with,
+		//so readers scan it as far as it goes instead of trusting its index
+		if (!WriteBuffer())
+			return;
+
+		ssize_t result;
+		do
+			result = pwrite(_fd, &_segment, sizeof(_segment), (off_t) _segmentStart);
+		while (result < 0 && errno == EINTR);
+		if (result != (ssize_t) sizeof(_segment))
+			Failed(result < 0 ? errno : EIO);
+	}
+
+	void BinaryLogSink::Failed(int error)
+	{
+		_errors.fetch_add(1, memory_order_relaxed);
+		_lastError.store(error, memory_order_relaxed);
+	}
+
+	//Writes out the buffer and advances _written by what actually reached the file.
+	//Returns false if some of it didn't; the rest is dropped, and the caller has to
+	//start a new segment since the current one's offsets no longer hold. Must be
+	//called with _lock held.
+	bool BinaryLogSink::WriteBuffer()
+	{
+		size_t done = 0;
+		int error = 0;
+		while (done < _buffer.size())
+		{
+			ssize_t result = pwrite(_fd, &_buffer[done], _buffer.size() - done, (off_t)(_written + done));
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result <= 0)
+			{
+				error = result < 0 ? errno : EIO;
+				break;
+			}
+			done += (size_t) result;
+		}
+		_written += done;
+		_buffer.clear();
+		if (error != 0)
+			Failed(error);
+		return error == 0;
+	}
+
+	//Must be called with _lock held
+	void BinaryLogSink::Append(RecordHeader &header, const char *text, size_t length)
+	{
+		const char *bytes = (const char *) &header;
+		_buffer.insert(_buffer.end(), bytes, bytes + sizeof(header));
+		_buffer.insert(_buffer.end(), text, text + length);
+		_buffer.resize(_buffer.size() + (RecordSize(header.length) - sizeof(header) - length));
+		_segment.dataSize += RecordSize(header.length);
+	}
+
+	//Must be called with _lock held
+	void BinaryLogSink::DefineSite(const LogSite &site, uint64_t timestamp)
+	{
+		uint32_t id = site.id.load(memory_order_relaxed);
+		if (id < _defined.size() && _defined[id])
+			return;
+		if (id >= _defined.size())
+			_defined.resize(id + 1);
+		_defined[id] = true;
+
+		string definition((const char *) &site.line, sizeof(uint32_t));
+		definition.append(site.file).push_back('\0');
+		definition.append(site.function).push_back('\0');
+		definition.append((const char *) site.format, _tcsclen(site.format) * sizeof(TCHAR)).push_back('\0');
+
+		RecordHeader header;
+		header.timestamp = timestamp;
+		header.thread = 0;
+		header.site = id;
+		header.length = (uint32_t) definition.size();
+		header.level = (uint8_t) site.level;
+		header.flags = SiteDefinition;
+		header.cpu = 0;
+		header.sequence = 0;
+
+		_sites.push_back(_written + _buffer.size() - _segmentStart - sizeof(SegmentHeader));
+		Append(header, definition.data(), definition.size());
+	}
+
+	//Encodes the record's arguments into _scratch, if all of them can be
+	bool BinaryLogSink::Encode(const LogRecord &record)
+	{
+		_scratch.clear();
+		if (record.site == nullptr || sizeof(TCHAR) != 1)
+			return false;
+
+		for (size_t i = 0; i < record.argumentCount; ++i)
+		{
+			const LogArgument &argument = record.arguments[i];
+			if (argument.type == LogArgument::Other || (argument.type == LogArgument::String && argument.s.length > UINT32_MAX))
+				return false;
+
+			_scratch.push_back((char) argument.type);
+			_scratch.push_back((char) argument.size);
+			if (argument.type == LogArgument::String)
+			{
+				uint32_t length = (uint32_t) argument.s.length;
+				_scratch.append((const char *) &length, sizeof(length));
+				_scratch.append(argument.s.data, argument.s.length);
+			}
+			else
+				_scratch.append((const char *) &argument.u, sizeof(argument.u));
+		}
+		return true;
+	}
+
+	void BinaryLogSink::Write(const LogRecord &record)
+	{
+		if (_fd < 0)
+			return;
+
+		//Keep only the text; the level and line ending are restored when rendering
+		const char *text = (const char *) record.message;
+		size_t length = record.length * sizeof(TCHAR);
+		uint8_t flags = 0;
+		size_t prefix = _tcsclen(logPrefixes[record.level]) * sizeof(TCHAR);
+		if (length >= prefix && memcmp(text, logPrefixes[record.level], prefix) == 0)
+		{
+			text += prefix;
+			length -= prefix;
+			flags |= PrefixStripped;
+		}
+		while (length != 0 && (text[length - 1] == '\n' || text[length - 1] == '\r'))
+			--length;
+
+		RecordHeader header;
+		header.thread = record.thread;
+		header.site = record.site != nullptr ? record.site->id.load(memory_order_relaxed) : 0;
+		header.level = (uint8_t) record.level;
+		header.cpu = record.cpu >= 0 && record.cpu < UINT16_MAX ? (uint16_t)(record.cpu + 1) : 0;
+		header.sequence = record.sequence;
+
+		lock_guard<mutex> lock(_lock);
+
+		if (Encode(record))
+		{
+			text = _scratch.data();
+			length = _scratch.size();
+			flags |= Encoded;
+		}
+		header.length = (uint32_t) length;
+		header.flags = flags;
+
+		//Stamped under the lock unless the caller already did, in which case the caller's
+		//time is kept as is. Our own stamps never go back past the previous one.
+		header.timestamp = record.timestamp;
+		if (header.timestamp == 0)
+		{
+			timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			uint64_t timestamp = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+			header.timestamp = _lastTimestamp = max(timestamp, _lastTimestamp);
+		}
+		if (_segment.recordCount != 0 && header.timestamp < _segment.maxTime)
+			_segment.flags |= Unordered;
+
+		if (flags & Encoded)
+			DefineSite(*record.site, header.timestamp);
+
+		uint64_t offset = _written + _buffer.size() - _segmentStart - sizeof(SegmentHeader);
+		if (_segment.recordCount % _indexInterval == 0)
+		{
+			//The latest time so far, so no earlier record can match a query this skips
+			IndexEntry entry = { max(header.timestamp, _segment.maxTime), offset };
+			_index.push_back(entry);
+		}
+
+		Append(header, text, length);
+
+		_segment.recordCount++;
+		_segment.minTime = min(_segment.minTime, header.timestamp);
+		_segment.maxTime = max(_segment.maxTime, header.timestamp);
+		_segment.levelMask |= 1u << record.level;
+
+		if (_segment.recordCount == _segmentRecords)
+		{
+			CloseSegment();
+			OpenSegment();
+		}
+		else if (_buffer.size() >= 64 * 1024 && !WriteBuffer())
+			OpenSegment();
+	}
+
+	void BinaryLogSink::Flush()
+	{
+		if (_fd < 0)
+			return;
+
+		lock_guard<mutex> lock(_lock);
+		if (!WriteBuffer())
+			OpenSegment();
+	}
+
+	//Holds _lock across the fork, with the buffer already written out
+	void BinaryLogSink::PrepareFork()
+	{
+		if (_fd < 0)
+			return;
+
+		_lock.lock();
+		if (!WriteBuffer())
+			OpenSegment();
+	}
+
+	void BinaryLogSink::AfterFork(bool child)
+	{
+		if (_fd < 0)
+			return;
+
+		//The segment being written belongs to the parent; the child stops logging here
+		if (child)
+		{
+			close(_fd);
+			_fd = -1;
+		}
+		_lock.unlock();
+	}
+
+	BinaryLogReader::BinaryLogReader(const char *path)
+		: _data(nullptr), _size(0)
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			void *mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapping != MAP_FAILED)
+			{
+				_data = (const char *) mapping;
+				_size = (size_t) info.st_size;
+				madvise(mapping, _size, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+	}
+
+	BinaryLogReader::~BinaryLogReader()
+	{
+		if (_data != nullptr)
+			munmap((void *) _data, _size);
+	}
+
+	bool BinaryLogReader::NextSegment(size_t &offset, Segment &segment) const
+	{
+		if (_data == nullptr || offset + sizeof(SegmentHeader) > _size)
+			return false;
+
+		segment.header = (const SegmentHeader *)(_data + offset);
+		if (memcmp(segment.header->magic, segmentMagic, sizeof(segmentMagic)) != 0)
+			return false;
+		segment.data = (const char *)(segment.header + 1);
+
+		size_t available = _size - offset - sizeof(SegmentHeader);
+		uint64_t indexSize = (uint64_t) segment.header->indexCount * sizeof(IndexEntry);
+		uint64_t sitesSize = (uint64_t) segment.header->siteCount * sizeof(uint64_t);
+		if (segment.header->recordCount != 0 && segment.header->dataSize + indexSize + sitesSize <= available)
+		{
+			segment.dataSize = (size_t) segment.header->dataSize;
+			segment.index = (const IndexEntry *)(segment.data + segment.dataSize);
+			segment.sites = (const uint64_t *)(segment.index + segment.header->indexCount);
+			offset += sizeof(SegmentHeader) + segment.dataSize + (size_t)(indexSize + sitesSize);
+			return true;
+		}
+
+		//An unfinished segment (the writer is still running or died): take everything up to
+		//the next segment or the end of the file, without an index
+		size_t length = 0;
+		while (length + sizeof(RecordHeader) <= available)
+		{
+			const RecordHeader *record = (const RecordHeader *)(segment.data + length);
+			if (memcmp(record, segmentMagic, sizeof(segmentMagic)) == 0 || !Readable(*record, available - length))
+				break;
+			length += RecordSize(record->length);
+		}
+		segment.dataSize = length;
+		segment.index = nullptr;
+		segment.sites = nullptr;
+		offset += sizeof(SegmentHeader) + length;
+		return true;
+	}
+
+	bool BinaryLogReader::Matches(const Segment &segment, const Query &query)
+	{
+		//Unfinished segments have no summary to go on
+		if (segment.header->recordCount == 0)
+			return true;
+		if (segment.header->maxTime < query.from || segment.header->minTime > query.to)
+			return false;
+		return (segment.header->levelMask >> query.level) != 0;
+	}
+
+	void BinaryLogReader::LoadSites(const Segment &segment, map<uint32_t, const RecordHeader *> &sites)
+	{
+		if (segment.sites == nullptr)
+			return;
+
+		for (uint32_t i = 0; i < segment.header->siteCount; ++i)
+		{
+			uint64_t offset = segment.sites[i];
+			if (offset + sizeof(RecordHeader) > segment.dataSize)
+				continue;
+			const RecordHeader *site = (const RecordHeader *)(segment.data + offset);
+			if (site->flags & SiteDefinition)
+				sites[site->site] = site;
+		}
+	}
+
+	//One decoded argument; the integer is kept at its original width so %x and
+	//friends print exactly what the original call would have
+	struct DecodedArgument
+	{
+		LogArgument::Type type;
+		uint8_t size;
+		short s;
+		int i;
+		long long ll;
+		unsigned short us;
+		unsigned int ui;
+		unsigned long long ull;
+		double d;
+		string text;
+	};
+
+	static bool Decode(const BinaryLogReader::Entry &entry, ostream &output)
+	{
+		const char *data = entry.text;
+		const char *end = data + entry.header->length;
+
+		vector<DecodedArgument> values;
+		while (data != end)
+		{
+			if (end - data < 2)
+				return false;
+			LogArgument::Type type = (LogArgument::Type) data[0];
+			uint8_t size = (uint8_t) data[1];
+			data += 2;
+
+			values.emplace_back();
+			DecodedArgument &value = values.back();
+			value.type = type;
+			value.size = size;
+			if (type == LogArgument::String)
+			{
+				uint32_t length;
+				if (end - data < (ptrdiff_t) sizeof(length))
+					return false;
+				memcpy(&length, data, sizeof(length));
+				data += sizeof(length);
+				if ((size_t)(end - data) < length)
+					return false;
+				value.text.assign(data, length);
+				data += length;
+				continue;
+			}
+
+			uint64_t bits;
+			if (end - data < (ptrdiff_t) sizeof(bits))
+				return false;
+			memcpy(&bits, data, sizeof(bits));
+			data += sizeof(bits);
+			value.s = (short) bits;
+			value.i = (int) bits;
+			value.ll = (long long) bits;
+			value.us = (unsigned short) bits;
+			value.ui = (unsigned int) bits;
+			value.ull = bits;
+			memcpy(&value.d, &bits, sizeof(bits));
+		}
+
+		//Only build the list once the vector has stopped moving
+		vector<tfm::detail::FormatArg> arguments;
+		for (const DecodedArgument &value : values)
+		{
+			bool isSigned = value.type == LogArgument::Signed;
+			if (value.type == LogArgument::String)
+				arguments.emplace_back(value.text);
+			else if (value.type == LogArgument::Float)
+				arguments.emplace_back(value.d);
+			else if (value.size == sizeof(short))
+				isSigned ? arguments.emplace_back(value.s) : arguments.emplace_back(value.us);
+			else if (value.size == sizeof(int))
+				isSigned ? arguments.emplace_back(value.i) : arguments.emplace_back(value.ui);
+			else
+				isSigned ? arguments.emplace_back(value.ll) : arguments.emplace_back(value.ull);
+		}
+
+		//Skip the line, file and function, without trusting the definition to be terminated
+		const char *format = (const char *)(entry.site + 1) + sizeof(uint32_t);
+		const char *definitionEnd = (const char *)(entry.site + 1) + entry.site->length;
+		for (int field = 0; field < 3; ++field)
+		{
+			const char *terminator = format < definitionEnd ? (const char *) memchr(format, '\0', definitionEnd - format) : nullptr;
+			if (terminator == nullptr)
+				return false;
+			if (field < 2)
+				format = terminator + 1;
+		}
+		tfm::vformat(output, format, tfm::FormatList(arguments.data(), (int) arguments.size()));
+		return true;
+	}
+
+	string BinaryLogReader::Render(const Entry &entry)
+	{
+		string result;
+		if (entry.header->level > Passthru)
+			result = "<corrupt record>";
+		else if (entry.header->flags & Encoded)
+		{
+			//Indentation isn't kept for encoded records
+			ostringstream output;
+			output << logPrefixes[entry.header->level];
+			if (entry.site == nullptr || !Decode(entry, output))
+				output << "<undecodable record from site " << entry.header->site << ">";
+			result = output.str();
+			while (!result.empty() && (result.back() == '\n' || result.back() == '\r'))
+				result.pop_back();
+		}
+		else
+		{
+			if (entry.header->flags & PrefixStripped)
+				result = logPrefixes[entry.header->level];
+			result.append(entry.text, entry.header->length);
+		}
+		result += "\r\n";
+		return result;
+	}
+}
+#endif
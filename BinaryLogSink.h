@@ -0,0 +1,260 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+#include <stdint.h>
+
+/* Binary log format
+ * BinaryLogSink writes records as fixed headers (timestamp, level, thread,
+ * CPU, call site, per-thread sequence number) followed by the message text
+ * without its level prefix or line ending. Records are grouped into segments;
+ * each segment starts with a SegmentHeader giving its time range, the levels
+ * it contains and its size, and ends with a sparse index of (timestamp,
+ * offset) pairs taken every indexInterval records. The header of a segment is
+ * only filled in once the segment is closed, so a segment cut short by a crash
+ * has zero sizes and is read by scanning its records up to the end of the file.
+ *
+ * Records stamped by the caller (as ShardedSink does when queueing) keep their
+ * timestamp, so a segment can hold them out of time order; such segments are
+ * flagged Unordered. Each index entry holds the latest timestamp seen up to
+ * its record, so starting from the index never skips a match either way.
+ *
+ * Records from NST_LOG statements whose arguments are all numbers or strings
+ * are stored as their call site id plus the encoded arguments, and only
+ * formatted when read back. The first record from a site in each segment is
+ * preceded by a SiteDefinition record holding the site's line, file,
+ * function and format string; closed segments list the offsets of these
+ * definitions after the index (siteCount entries).
+ *
+ * Failed writes are counted in Errors(), with the latest errno in LastError().
+ * The records that didn't reach the file are dropped along with the rest of
+ * their segment, which is left for readers to scan like an unfinished one, and
+ * writing carries on in a new segment.
+ *
+ * BinaryLogReader walks such a file, using the segment headers to skip
+ * whole segments that can't match a query and the index to start close to
+ * the requested time. tools/logquery is its command-line front end.
+*/
+
+namespace neosmart
+{
+	namespace BinaryLog
+	{
+		struct SegmentHeader
+		{
+			char magic[8];
+			uint32_t recordCount;
+			uint32_t indexCount;
+			uint64_t dataSize;
+			uint64_t minTime;
+			uint64_t maxTime;
+			uint32_t levelMask;
+			uint32_t siteCount;
+			uint32_t flags;
+			uint32_t reserved;
+		};
+
+		struct RecordHeader
+		{
+			uint64_t timestamp;
+			uint32_t thread;
+			uint32_t site;
+			uint32_t length;
+			uint8_t level;
+			uint8_t flags;
+			//One more than the CPU the record was logged on, or 0 if unknown
+			uint16_t cpu;
+			//LogRecord::sequence; 0 for site definitions
+			uint64_t sequence;
+		};
+
+		struct IndexEntry
+		{
+			uint64_t timestamp;
+			uint64_t offset;
+		};
+
+		//Set when the level prefix was removed from the text and should be restored
+		const uint8_t PrefixStripped = 1;
+		//The text is a list of encoded arguments for the format string of the record's site
+		const uint8_t Encoded = 2;
+		//Not a log record: describes the site given in the header (line, then file, function and format)
+		const uint8_t SiteDefinition = 4;
+
+		//Segment flag: the records aren't in timestamp order
+		const uint32_t Unordered = 1;
+
+		//Records are padded so every header stays 8-byte aligned
+		inline size_t RecordSize(uint32_t length)
+		{
+			return (sizeof(RecordHeader) + length + 7) & ~(size_t)7;
+		}
+
+		//A record that runs past the available bytes or has no valid level is corrupt,
+		//and readers treat it as the end of its segment
+		inline bool Readable(const RecordHeader &record, size_t available)
+		{
+			return record.level <= Passthru && RecordSize(record.length) <= available;
+		}
+	}
+
+	class BinaryLogSink : public LogSink
+	{
+		int _fd;
+		std::mutex _lock;
+		std::vector<char> _buffer;
+		std::vector<BinaryLog::IndexEntry> _index;
+		std::vector<uint64_t> _sites;
+		std::vector<bool> _defined;
+		std::string _scratch;
+		BinaryLog::SegmentHeader _segment;
+		uint64_t _segmentStart;
+		uint64_t _written;
+		uint64_t _lastTimestamp;
+		uint32_t _segmentRecords;
+		uint32_t _indexInterval;
+		std::atomic<uint64_t> _errors;
+		std::atomic<int> _lastError;
+
+		void OpenSegment();
+		void CloseSegment();
+		bool WriteBuffer();
+		void Failed(int error);
+		void Append(BinaryLog::RecordHeader &header, const char *text, size_t length);
+		void DefineSite(const LogSite &site, uint64_t timestamp);
+		bool Encode(const LogRecord &record);
+
+	public:
+		BinaryLogSink(const char *path, uint32_t segmentRecords = 16384, uint32_t indexInterval = 256);
+		~BinaryLogSink();
+
+		bool IsOpen() const { return _fd >= 0; }
+		uint64_t Errors() const { return _errors.load(std::memory_order_relaxed); }
+		int LastError() const { return _lastError.load(std::memory_order_relaxed); }
+
+		virtual void Write(const LogRecord &record);
+		virtual void Flush();
+		virtual bool UsesArguments() const { return true; }
+		virtual void PrepareFork();
+		virtual void AfterFork(bool child);
+	};
+
+	class BinaryLogReader
+	{
+		const char *_data;
+		size_t _size;
+
+	public:
+		struct Query
+		{
+			uint64_t from;
+			uint64_t to;
+			LogLevel level;
+			const char *substring;
+
+			Query() : from(0), to(UINT64_MAX), level(neosmart::Debug), substring(nullptr) {}
+		};
+
+		struct Entry
+		{
+			const BinaryLog::RecordHeader *header;
+			const char *text;
+			//The SiteDefinition for an Encoded record, if it was found
+			const BinaryLog::RecordHeader *site;
+		};
+
+		BinaryLogReader(const char *path);
+		~BinaryLogReader();
+
+		bool IsOpen() const { return _data != nullptr; }
+
+		//Calls visit for every matching record in file order; stops early if it returns false
+		template<typename Visitor>
+		void Search(const Query &query, Visitor visit) const;
+
+		//Formats a record the way the text destinations would have
+		static std::string Render(const Entry &entry);
+
+		//Lower-level access used by Search()
+		struct Segment
+		{
+			const BinaryLog::SegmentHeader *header;
+			const char *data;
+			size_t dataSize;
+			const BinaryLog::IndexEntry *index;
+			const uint64_t *sites;
+		};
+		bool NextSegment(size_t &offset, Segment &segment) const;
+		static bool Matches(const Segment &segment, const Query &query);
+		static void LoadSites(const Segment &segment, std::map<uint32_t, const BinaryLog::RecordHeader *> &sites);
+	};
+
+	template<typename Visitor>
+	void BinaryLogReader::Search(const Query &query, Visitor visit) const
+	{
+		size_t needleLength = query.substring != nullptr ? strlen(query.substring) : 0;
+		std::map<uint32_t, const BinaryLog::RecordHeader *> sites;
+
+		Segment segment;
+		for (size_t offset = 0; NextSegment(offset, segment); )
+		{
+			if (!Matches(segment, query))
+				continue;
+
+			//Skip the segment outright if the text isn't anywhere in it. Encoded records are
+			//only searchable once rendered, so this needs a closed segment without any.
+			bool plain = segment.header->recordCount != 0 && segment.header->siteCount == 0;
+			if (needleLength != 0 && plain && memmem(segment.data, segment.dataSize, query.substring, needleLength) == nullptr)
+				continue;
+
+			//Unfinished segments have no site list; their definitions are picked up while scanning
+			sites.clear();
+			LoadSites(segment, sites);
+
+			//Start from the last index entry before the requested time. Only a closed, ordered
+			//segment can be left as soon as a record is past the end of the range.
+			bool ordered = segment.header->recordCount != 0 && !(segment.header->flags & BinaryLog::Unordered);
+			size_t position = 0;
+			for (uint32_t i = 0; i < segment.header->indexCount && segment.index[i].timestamp < query.from; ++i)
+				position = (size_t) segment.index[i].offset;
+
+			while (position + sizeof(BinaryLog::RecordHeader) <= segment.dataSize)
+			{
+				Entry entry;
+				entry.header = (const BinaryLog::RecordHeader *)(segment.data + position);
+				entry.text = (const char *)(entry.header + 1);
+				entry.site = nullptr;
+				if (!BinaryLog::Readable(*entry.header, segment.dataSize - position))
+					break;
+				position += BinaryLog::RecordSize(entry.header->length);
+
+				if (entry.header->flags & BinaryLog::SiteDefinition)
+				{
+					sites[entry.header->site] = entry.header;
+					continue;
+				}
+				if (entry.header->timestamp > query.to && ordered)
+					break;
+				if (entry.header->timestamp < query.from || entry.header->timestamp > query.to || entry.header->level < query.level)
+					continue;
+				if (entry.header->flags & BinaryLog::Encoded)
+				{
+					auto site = sites.find(entry.header->site);
+					entry.site = site != sites.end() ? site->second : nullptr;
+					if (needleLength != 0 && Render(entry).find(query.substring) == std::string::npos)
+						continue;
+				}
+				else if (needleLength != 0 && memmem(entry.text, entry.header->length, query.substring, needleLength) == nullptr)
+					continue;
+				if (!visit(entry))
+					return;
+			}
+		}
+	}
+}
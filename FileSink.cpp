@@ -0,0 +1,660 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "FileSink.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define NST_HAVE_IO_URING
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+using namespace std;
+
+namespace neosmart
+{
+	static const uint64_t syncMarker = ~(uint64_t)0;
+
+#ifdef NST_HAVE_IO_URING
+	//Just enough of io_uring to queue writes and fsyncs, without depending on liburing
+	struct FileSink::Ring
+	{
+		int fd;
+		void *sqRing, *cqRing;
+		size_t sqRingSize, cqRingSize;
+		io_uring_sqe *sqes;
+		size_t sqesSize;
+		unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+		unsigned *cqHead, *cqTail, *cqMask;
+		io_uring_cqe *cqes;
+
+		static Ring *Create(unsigned entries)
+		{
+			io_uring_params params = {};
+			int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+			if (fd < 0)
+				return nullptr;
+			if (!Supports(fd, IORING_OP_WRITE) || !Supports(fd, IORING_OP_FSYNC))
+			{
+				close(fd);
+				return nullptr;
+			}
+
+			Ring *ring = new Ring();
+			ring->fd = fd;
+			ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+				ring->sqRingSize = ring->cqRingSize = max(ring->sqRingSize, ring->cqRingSize);
+			ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+			ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			ring->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sqRing
+				: mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			ring->sqes = (io_uring_sqe *) mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+			{
+				delete ring;
+				return nullptr;
+			}
+
+			char *sq = (char *) ring->sqRing;
+			ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+			ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+			ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+			ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+			char *cq = (char *) ring->cqRing;
+			ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+			ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+			ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+			ring->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+			return ring;
+		}
+
+		//Asks the kernel once, at setup, rather than finding out from failed requests;
+		//kernels too old to answer can't write through a ring either
+		static bool Supports(int fd, uint8_t opcode)
+		{
+			static const unsigned count = 256;
+			vector<char> storage(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op));
+			io_uring_probe *probe = (io_uring_probe *) storage.data();
+			if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, count) < 0)
+				return false;
+			return opcode <= probe->last_op && opcode < probe->ops_len
+				&& (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+		}
+
+		~Ring()
+		{
+			if (sqes != MAP_FAILED)
+				munmap(sqes, sqesSize);
+			if (cqRing != MAP_FAILED && cqRing != sqRing)
+				munmap(cqRing, cqRingSize);
+			if (sqRing != MAP_FAILED)
+				munmap(sqRing, sqRingSize);
+			close(fd);
+		}
+
+		//Returns 0, or the error that kept the request from being submitted, in which
+		//case it is taken back off the queue and will never complete
+		int Queue(uint8_t opcode, int file, const void *data, unsigned length, uint64_t offset, uint64_t userData)
+		{
+			unsigned tail = *sqTail;
+			unsigned index = tail & *sqMask;
+			io_uring_sqe &sqe = sqes[index];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = opcode;
+			sqe.fd = file;
+			sqe.addr = (uint64_t)(uintptr_t) data;
+			sqe.len = length;
+			sqe.off = offset;
+			sqe.user_data = userData;
+			if (opcode == IORING_OP_FSYNC)
+			{
+				//Only start the sync once every earlier write has completed
+				sqe.flags = IOSQE_IO_DRAIN;
+				sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+			}
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+			for (int attempt = 0; ; ++attempt)
+			{
+				if (syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) >= 0)
+					return 0;
+				int error = errno;
+				if (error == EINTR)
+					continue;
+				if (error == EAGAIN && attempt < 1000)
+				{
+					sched_yield();
+					continue;
+				}
+				//The kernel only reads the tail when entered, so the entry can still be withdrawn
+				__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+				return error;
+			}
+		}
+
+		void Wait()
+		{
+			syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+
+		//Returns false once the completion queue is empty
+		bool Next(uint64_t &userData, int &result)
+		{
+			unsigned head = *cqHead;
+			if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+				return false;
+			const io_uring_cqe &cqe = cqes[head & *cqMask];
+			userData = cqe.user_data;
+			result = cqe.res;
+			__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+	};
+#else
+	struct FileSink::Ring
+	{
+	};
+#endif
+
+	FileSink::FileSink(const char *path, size_t bufferSize, size_t buffers, int syncInterval, int flushInterval)
+		: _offset(0), _capacity(max<size_t>(bufferSize, 4096)), _current(0), _inFlight(0), _dirty(false),
+		_stopping(false), _reaping(false), _committing(false), _syncQueued(false), _durable(0), _lost(0), _failedEnd(0), _errors(0), _lastError(0), _durableLevel(None), _syncInterval(syncInterval), _flushInterval(flushInterval), _lastSync(chrono::steady_clock::now())
+	{
+		_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (_fd < 0)
+			return;
+		off_t end = lseek(_fd, 0, SEEK_END);
+		_offset = end > 0 ? (uint64_t) end : 0;
+
+		_buffers.resize(max<size_t>(buffers, 2));
+		for (size_t i = 0; i < _buffers.size(); ++i)
+		{
+			_buffers[i].data = new char[_capacity];
+			_buffers[i].used = 0;
+			_buffers[i].offset = 0;
+			_buffers[i].written = 0;
+			_buffers[i].pending = false;
+			if (i != 0)
+				_free.push_back((int) i);
+		}
+
+#ifdef NST_HAVE_IO_URING
+		//One entry per buffer plus one for a pending fdatasync
+		_ring.reset(Ring::Create((unsigned) _buffers.size() + 1));
+#endif
+		_backend = thread(&FileSink::BackendLoop, this);
+	}
+
+	FileSink::~FileSink()
+	{
+		if (_fd < 0)
+			return;
+
+		Flush();
+		{
+			lock_guard<mutex> lock(_lock);
+			_stopping = true;
+		}
+		_wake.notify_one();
+		_backend.join();
+
+		if (_syncInterval > 0)
+			fdatasync(_fd);
+		_ring.reset();
+		close(_fd);
+		for (size_t i = 0; i < _buffers.size(); ++i)
+			delete[] _buffers[i].data;
+	}
+
+	//Writes whatever part of a buffer the kernel didn't, at the buffer's own offset;
+	//returns 0 or the error that stopped it
+	static int Complete(int fd, const char *data, size_t length, uint64_t offset, size_t written)
+	{
+		while (written < length)
+		{
+			ssize_t result = pwrite(fd, data + written, length - written, (off_t)(offset + written));
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result < 0)
+				return errno;
+			if (result == 0)
+				return EIO;
+			written += (size_t) result;
+		}
+		return 0;
+	}
+
+	void FileSink::Failed(int error)
+	{
+		_errors.fetch_add(1, memory_order_relaxed);
+		_lastError.store(error, memory_order_relaxed);
+	}
+
+	//Returns a submitted buffer to the free list, counting the error that ended it if
+	//there was one. Must be called with _lock held.
+	void FileSink::Release(int index, int error)
+	{
+		Buffer &buffer = _buffers[index];
+		if (error != 0)
+		{
+			Failed(error);
+			_failedEnd = max(_failedEnd, buffer.offset + buffer.used);
+		}
+		buffer.used = 0;
+		buffer.written = 0;
+		buffer.pending = false;
+		_free.push_back(index);
+		--_inFlight;
+		_released.notify_all();
+	}
+
+	//Copies a record into the current buffer, or writes it in place if it's too big
+	//for any; returns the file offset the record ends at
+	uint64_t FileSink::Append(unique_lock<mutex> &lock, const LogRecord &record)
+	{
+		const char *data = (const char *) record.message;
+		size_t length = record.length * sizeof(TCHAR);
+
+		if (length > _capacity)
+		{
+			//Too big for any buffer; let everything before it land, then write it in place
+			if (_current >= 0 && _buffers[_current].used != 0)
+				Submit();
+			Drain(lock);
+			int error = Complete(_fd, data, length, _offset, 0);
+			_offset += length;
+			if (error != 0)
+			{
+				Failed(error);
+				_failedEnd = _offset;
+			}
+			return _offset;
+		}
+
+		//Find room before copying anything, since waiting for a buffer releases the lock
+		//and the record must not be split around another thread's
+		while (_current < 0 || _buffers[_current].used + length > _capacity)
+		{
+			if (_current >= 0)
+				Submit();
+			Acquire(lock);
+		}
+
+		Buffer &buffer = _buffers[_current];
+		memcpy(buffer.data + buffer.used, data, length);
+		buffer.used += length;
+		uint64_t end = _offset + buffer.used;
+		if (buffer.used == _capacity)
+			Submit();
+		return end;
+	}
+
+	void FileSink::Write(const LogRecord &record)
+	{
+		if (_fd < 0)
+			return;
+
+		unique_lock<mutex> lock(_lock);
+		uint64_t end = Append(lock, record);
+		if (record.level >= _durableLevel)
+			Commit(lock, end);
+	}
+
+	void FileSink::WriteBatch(const LogRecord *records, size_t count)
+	{
+		if (_fd < 0 || count == 0)
+			return;
+
+		unique_lock<mutex> lock(_lock);
+		uint64_t end = 0;
+		for (size_t i = 0; i < count; ++i)
+			end = Append(lock, records[i]);
+		//A batch shares one level, so one commit covers every record in it
+		if (records[0].level >= _durableLevel)
+			Commit(lock, end);
+	}
+
+	void FileSink::SetDurableLevel(LogLevel level)
+	{
+		lock_guard<mutex> lock(_lock);
+		_durableLevel = level;
+	}
+
+	//Returns once everything up to end is on disk. Must be called with _lock held.
+	void FileSink::Commit(unique_lock<mutex> &lock, uint64_t end)
+	{
+		while (_durable < end)
+		{
+			//Our group's sync failed; another one can't make the record durable
+			if (end <= _lost)
+				return;
+
+			//Someone else is already syncing; their sync or the next one will cover us
+			if (_committing)
+			{
+				_committed.wait(lock);
+				continue;
+			}
+
+			_committing = true;
+			if (_current >= 0 && _buffers[_current].used != 0)
+				Submit();
+			uint64_t covered = _offset;
+			while (!Written(covered))
+				WaitForWrites(lock);
+
+			//Producers keep appending while we sync and will form the next group
+			lock.unlock();
+			int result;
+			do
+				result = fdatasync(_fd);
+			while (result < 0 && errno == EINTR);
+			int error = result < 0 ? errno : 0;
+			lock.lock();
+
+			if (error != 0)
+				Failed(error);
+			if (error != 0 || _failedEnd > max(_durable, _lost))
+				_lost = max(_lost, covered);
+			else
+				_durable = max(_durable, covered);
+			_committing = false;
+			_committed.notify_all();
+		}
+	}
+
+	//Hands the current buffer to the kernel (or the writer thread) and leaves no buffer
+	//current until the next Acquire(). Must be called with _lock held.
+	void FileSink::Submit()
+	{
+		Buffer &buffer = _buffers[_current];
+		buffer.offset = _offset;
+		buffer.pending = true;
+		_offset += buffer.used;
+		++_inFlight;
+		_dirty = true;
+
+#ifdef NST_HAVE_IO_URING
+		if (_ring)
+		{
+			int error = _ring->Queue(IORING_OP_WRITE, _fd, buffer.data, (unsigned) buffer.used, buffer.offset, (uint64_t) _current);
+			if (error != 0)
+				Release(_current, error);
+		}
+		else
+#endif
+		{
+			_queued.push_back(_current);
+			_wake.notify_one();
+		}
+		_current = -1;
+	}
+
+	//Makes a free buffer current, waiting for one to be written if necessary
+	void FileSink::Acquire(unique_lock<mutex> &lock)
+	{
+		Reap();
+		while (_current < 0 && _free.empty())
+			WaitForWrites(lock);
+		if (_current < 0)
+		{
+			_current = _free.back();
+			_free.pop_back();
+		}
+	}
+
+	//Blocks until at least one more submitted buffer has been written. Must be called
+	//with _lock held and with at least one buffer in flight.
+	void FileSink::WaitForWrites(unique_lock<mutex> &lock)
+	{
+		//Only one thread at a time waits on the ring itself, and it alone reaps while it
+		//waits, so that nobody else can consume the completion it's blocked on.
+		if (_ring && !_reaping)
+		{
+			_reaping = true;
+			lock.unlock();
+#ifdef NST_HAVE_IO_URING
+			_ring->Wait();
+#endif
+			lock.lock();
+			_reaping = false;
+			Reap();
+			_released.notify_all();
+			return;
+		}
+		_released.wait(lock);
+	}
+
+	//Whether every byte before end has been written
+	bool FileSink::Written(uint64_t end) const
+	{
+		for (size_t i = 0; i < _buffers.size(); ++i)
+		{
+			if (_buffers[i].pending && _buffers[i].offset < end)
+				return false;
+		}
+		return true;
+	}
+
+	//Collects finished io_uring requests. Must be called with _lock held.
+	void FileSink::Reap()
+	{
+#ifdef NST_HAVE_IO_URING
+		if (!_ring || _reaping)
+			return;
+
+		uint64_t userData;
+		int result;
+		while (_ring->Next(userData, result))
+		{
+			if (userData == syncMarker)
+			{
+				_syncQueued = false;
+				if (result < 0)
+					Failed(-result);
+				continue;
+			}
+
+			//The opcodes were probed when the ring was set up, so a short or interrupted
+			//write only needs its remainder queued again; anything else is an I/O error.
+			Buffer &buffer = _buffers[(size_t) userData];
+			if (result > 0)
+				buffer.written += (size_t) result;
+			int error = 0;
+			if (buffer.written < buffer.used && (result > 0 || result == -EINTR || result == -EAGAIN))
+			{
+				error = _ring->Queue(IORING_OP_WRITE, _fd, buffer.data + buffer.written, (unsigned)(buffer.used - buffer.written),
+					buffer.offset + buffer.written, userData);
+				if (error == 0)
+				{
+					_dirty = true;
+					continue;
+				}
+			}
+			else if (buffer.written < buffer.used)
+				error = result < 0 ? -result : EIO;
+			Release((int) userData, error);
+		}
+#endif
+	}
+
+	//Writes out every queued buffer with a single writev. Must be called with _lock held
+	//and only from the backend thread; the lock is released during the write.
+	void FileSink::WriteQueued(unique_lock<mutex> &lock)
+	{
+		vector<int> batch(_queued.begin(), _queued.end());
+		_queued.clear();
+		if (batch.size() > IOV_MAX)
+		{
+			_queued.insert(_queued.end(), batch.begin() + IOV_MAX, batch.end());
+			batch.resize(IOV_MAX);
+		}
+		uint64_t offset = _buffers[batch[0]].offset;
+
+		lock.unlock();
+		vector<iovec> vectors(batch.size());
+		size_t total = 0;
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			vectors[i].iov_base = _buffers[batch[i]].data;
+			vectors[i].iov_len = _buffers[batch[i]].used;
+			total += vectors[i].iov_len;
+		}
+		ssize_t written;
+		do
+			written = pwritev(_fd, &vectors[0], (int) vectors.size(), (off_t) offset);
+		while (written < 0 && errno == EINTR);
+
+		//Finish any buffers the vectored write left incomplete
+		size_t done = written > 0 ? (size_t) written : 0;
+		uint64_t failedEnd = 0;
+		if (done < total)
+		{
+			for (size_t i = 0; i < batch.size(); ++i)
+			{
+				Buffer &buffer = _buffers[batch[i]];
+				int error = Complete(_fd, buffer.data, buffer.used, buffer.offset, min(done, buffer.used));
+				done -= min(done, buffer.used);
+				if (error != 0)
+				{
+					Failed(error);
+					failedEnd = buffer.offset + buffer.used;
+				}
+			}
+		}
+		lock.lock();
+		_failedEnd = max(_failedEnd, failedEnd);
+
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			_buffers[batch[i]].used = 0;
+			_buffers[batch[i]].pending = false;
+			_free.push_back(batch[i]);
+		}
+		_inFlight -= batch.size();
+		_released.notify_all();
+	}
+
+	//Must be called with _lock held, from the backend thread
+	void FileSink::Sync(unique_lock<mutex> &lock)
+	{
+#ifdef NST_HAVE_IO_URING
+		if (_ring)
+		{
+			//One sync at a time, so uncollected completions can't outgrow the queue;
+			//the file stays dirty until the next interval if one is still running
+			if (_syncQueued)
+				return;
+			_dirty = false;
+			_lastSync = chrono::steady_clock::now();
+			int error = _ring->Queue(IORING_OP_FSYNC, _fd, nullptr, 0, 0, syncMarker);
+			if (error != 0)
+				Failed(error);
+			_syncQueued = error == 0;
+			return;
+		}
+#endif
+		_dirty = false;
+		_lastSync = chrono::steady_clock::now();
+		lock.unlock();
+		if (fdatasync(_fd) < 0 && errno != EINTR)
+			Failed(errno);
+		lock.lock();
+	}
+
+	void FileSink::BackendLoop()
+	{
+		unique_lock<mutex> lock(_lock);
+		while (true)
+		{
+			if (!_queued.empty())
+			{
+				WriteQueued(lock);
+				continue;
+			}
+			if (_stopping)
+				break;
+
+			if (_wake.wait_for(lock, chrono::milliseconds(_flushInterval)) == cv_status::no_timeout && !_queued.empty())
+				continue;
+
+			Reap();
+
+			//Push out a partially filled buffer so quiet periods still reach the file
+			if (_current >= 0 && _buffers[_current].used != 0)
+				Submit();
+
+			if (_syncInterval > 0 && _dirty
+				&& chrono::steady_clock::now() - _lastSync >= chrono::milliseconds(_syncInterval))
+				Sync(lock);
+		}
+	}
+
+	void FileSink::Flush()
+	{
+		if (_fd < 0)
+			return;
+
+		unique_lock<mutex> lock(_lock);
+		if (_current >= 0 && _buffers[_current].used != 0)
+			Submit();
+		Drain(lock);
+	}
+
+	//Holds _lock across the fork, with every buffer written and nothing in flight
+	void FileSink::PrepareFork()
+	{
+		if (_fd < 0)
+			return;
+
+		unique_lock<mutex> lock(_lock);
+		if (_current >= 0 && _buffers[_current].used != 0)
+			Submit();
+		Drain(lock);
+		lock.release();
+	}
+
+	void FileSink::AfterFork(bool child)
+	{
+		if (_fd < 0)
+			return;
+
+		//The backend wasn't forked and the file's offsets are the parent's to advance,
+		//so the child stops logging here rather than overwrite the parent's records
+		if (child)
+		{
+			new (&_backend) thread();
+			_ring.reset();
+			close(_fd);
+			_fd = -1;
+			for (size_t i = 0; i < _buffers.size(); ++i)
+				delete[] _buffers[i].data;
+			_buffers.clear();
+			_current = -1;
+		}
+		_lock.unlock();
+	}
+
+	//Waits for every submitted buffer to be written. Must be called with _lock held.
+	void FileSink::Drain(unique_lock<mutex> &lock)
+	{
+		while (_inFlight != 0)
+			WaitForWrites(lock);
+	}
+}
+#endif
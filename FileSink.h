@@ -0,0 +1,121 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+
+/* Asynchronous file destination
+ * Records are appended to one of a handful of fixed buffers. A full buffer is
+ * handed to the kernel without waiting for it to reach the disk, and writing
+ * continues into the next one, so a slow volume only holds up callers once
+ * every buffer is in flight.
+ *
+ * On Linux the buffers are submitted through io_uring, optionally followed by
+ * an ordered fdatasync every syncInterval milliseconds. The ring is only used
+ * if the kernel reports supporting both operations when the sink is opened.
+ * Where it doesn't, or io_uring is not available at all (seccomp sandboxes,
+ * other platforms), a background thread writes queued buffers with writev()
+ * instead. Either way, a partially
+ * filled buffer is written out after flushInterval milliseconds.
+ *
+ * The file is written at explicit offsets from its end at open time, so it
+ * must not be shared with other writers.
+ *
+ * SetDurableLevel() makes records at or above a level durable: Write() only
+ * returns once the record has been fdatasync'ed. Durable writers commit as a
+ * group; one caller syncs on behalf of everyone who appended before it
+ * started, and callers that arrive meanwhile are covered by the next sync.
+ *
+ * Failed writes and syncs are counted in Errors(), with the latest errno in
+ * LastError(). If a group's sync fails, or a write in its range did, its
+ * durable callers return without their records being durable; a later sync
+ * can't vouch for data the kernel already reported lost.
+*/
+
+namespace neosmart
+{
+	class FileSink : public LogSink
+	{
+		struct Buffer
+		{
+			char *data;
+			size_t used;
+			uint64_t offset;
+			//Bytes the ring has written so far
+			size_t written;
+			bool pending;
+		};
+		struct Ring;
+
+		int _fd;
+		uint64_t _offset;
+		size_t _capacity;
+		std::vector<Buffer> _buffers;
+		std::vector<int> _free;
+		std::deque<int> _queued;
+		int _current;
+		size_t _inFlight;
+		bool _dirty;
+		bool _stopping;
+		bool _reaping;
+		bool _committing;
+		//A periodic fdatasync is on the ring and hasn't been reaped
+		bool _syncQueued;
+		uint64_t _durable;
+		//End of the latest range given up on after a failure, and of the latest failed write
+		uint64_t _lost;
+		uint64_t _failedEnd;
+		std::atomic<uint64_t> _errors;
+		std::atomic<int> _lastError;
+		LogLevel _durableLevel;
+		int _syncInterval;
+		int _flushInterval;
+		std::chrono::steady_clock::time_point _lastSync;
+		std::unique_ptr<Ring> _ring;
+
+		std::mutex _lock;
+		std::condition_variable _wake;
+		std::condition_variable _released;
+		std::condition_variable _committed;
+		std::thread _backend;
+
+		void Submit();
+		uint64_t Append(std::unique_lock<std::mutex> &lock, const LogRecord &record);
+		void Acquire(std::unique_lock<std::mutex> &lock);
+		void Drain(std::unique_lock<std::mutex> &lock);
+		void WaitForWrites(std::unique_lock<std::mutex> &lock);
+		bool Written(uint64_t end) const;
+		void Commit(std::unique_lock<std::mutex> &lock, uint64_t end);
+		void Reap();
+		void WriteQueued(std::unique_lock<std::mutex> &lock);
+		void Sync(std::unique_lock<std::mutex> &lock);
+		void Failed(int error);
+		void Release(int index, int error);
+		void BackendLoop();
+
+	public:
+		FileSink(const char *path, size_t bufferSize = 64 * 1024, size_t buffers = 4,
+			int syncInterval = 0, int flushInterval = 100);
+		~FileSink();
+
+		bool IsOpen() const { return _fd >= 0; }
+		bool UsesIoUring() const { return (bool) _ring; }
+		void SetDurableLevel(LogLevel level);
+		uint64_t Errors() const { return _errors.load(std::memory_order_relaxed); }
+		int LastError() const { return _lastError.load(std::memory_order_relaxed); }
+
+		virtual void Write(const LogRecord &record);
+		virtual void WriteBatch(const LogRecord *records, size_t count);
+		virtual void Flush();
+		virtual void PrepareFork();
+		virtual void AfterFork(bool child);
+	};
+}
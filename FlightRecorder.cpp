@@ -0,0 +1,235 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "FlightRecorder.h"
+#include <exception>
+#include <signal.h>
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+#define STDERR_FILENO 2
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace neosmart
+{
+	static const char recorderMagic[8] = "NSTFLT1";
+
+	static_assert(atomic<uint64_t>::is_always_lock_free, "the ring must be readable from a signal handler and other processes");
+
+	static atomic<FlightRecorder*> crashRecorder;
+	static terminate_handler previousTerminate;
+
+	FlightRecorder::FlightRecorder(size_t records, size_t recordSize, const char *path)
+		: _header(nullptr), _mapped(false)
+	{
+		//Keep every slot 8-byte aligned so the sequence numbers stay lock-free
+		recordSize = (max(recordSize, sizeof(Slot) + 1) + 7) & ~(size_t)7;
+		_size = sizeof(Header) + records * recordSize;
+
+#ifndef _WIN32
+		if (path != nullptr)
+		{
+			//Keep the previous run's recording, which may be all there is of its crash
+			struct stat info;
+			if (stat(path, &info) == 0 && info.st_size > 0)
+				rename(path, (string(path) + ".1").c_str());
+
+			int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd >= 0)
+			{
+				if (ftruncate(fd, (off_t)_size) == 0)
+				{
+					void *mapping = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+					if (mapping != MAP_FAILED)
+					{
+						_header = (Header *) mapping;
+						_mapped = true;
+					}
+				}
+				close(fd);
+			}
+		}
+#else
+		(void) path;
+#endif
+		if (_header == nullptr)
+			_header = (Header *) calloc(1, _size);
+
+		_header->slotSize = (uint32_t) recordSize;
+		_header->slotCount = (uint32_t) records;
+		_header->next = 0;
+		memcpy(_header->magic, recorderMagic, sizeof(recorderMagic));
+	}
+
+	FlightRecorder::~FlightRecorder()
+	{
+		FlightRecorder *self = this;
+		crashRecorder.compare_exchange_strong(self, nullptr);
+
+#ifndef _WIN32
+		if (_mapped)
+		{
+			munmap(_header, _size);
+			return;
+		}
+#endif
+		free(_header);
+	}
+
+	void FlightRecorder::Write(const LogRecord &record)
+	{
+		uint64_t ticket = _header->next.fetch_add(1, memory_order_relaxed);
+		Slot *slot = (Slot *)((char *)(_header + 1) + (ticket % _header->slotCount) * _header->slotSize);
+
+		size_t length = min(record.length * sizeof(TCHAR), _header->slotSize - sizeof(Slot));
+		slot->sequence.store(0, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		slot->length = (uint32_t) length;
+		slot->level = (uint32_t) record.level;
+		memcpy((char *)(slot + 1), record.message, length);
+		slot->sequence.store(ticket + 1, memory_order_release);
+	}
+
+	void FlightRecorder::DumpRing(const Header *header, int fd)
+	{
+		static const char banner[] = "--- flight recorder ---\n";
+		static const char footer[] = "--- end of flight recorder ---\n";
+
+		//Only write(2) from here on: this runs inside signal handlers
+		uint64_t next = header->next.load(memory_order_acquire);
+		uint64_t first = next > header->slotCount ? next - header->slotCount : 0;
+
+		ssize_t ignored = write(fd, banner, sizeof(banner) - 1);
+		for (uint64_t ticket = first; ticket < next; ++ticket)
+		{
+			const Slot *slot = (const Slot *)((const char *)(header + 1) + (ticket % header->slotCount) * header->slotSize);
+			if (slot->sequence.load(memory_order_acquire) != ticket + 1)
+				continue;
+
+			//Other threads keep logging while this runs and can claim the slot again at any
+			//point, so each piece is copied out and only written once the sequence shows
+			//the slot wasn't touched meanwhile
+			uint32_t length = min<uint32_t>(slot->length, header->slotSize - sizeof(Slot));
+			const char *text = (const char *)(slot + 1);
+			char copy[1024];
+			char last = '\n';
+			for (uint32_t done = 0; done < length; )
+			{
+				uint32_t piece = min<uint32_t>(length - done, sizeof(copy));
+				memcpy(copy, text + done, piece);
+				atomic_thread_fence(memory_order_acquire);
+				if (slot->sequence.load(memory_order_relaxed) != ticket + 1)
+					break;
+				ignored = write(fd, copy, piece);
+				last = copy[piece - 1];
+				done += piece;
+			}
+			if (last != '\n')
+				ignored = write(fd, "\n", 1);
+		}
+		ignored = write(fd, footer, sizeof(footer) - 1);
+		(void) ignored;
+	}
+
+	void FlightRecorder::Dump(int fd) const
+	{
+		DumpRing(_header, fd);
+	}
+
+	bool FlightRecorder::Dump(const char *path, int fd)
+	{
+#ifndef _WIN32
+		int file = open(path, O_RDONLY | O_CLOEXEC);
+		if (file < 0)
+			return false;
+
+		struct stat info;
+		void *mapping = MAP_FAILED;
+		if (fstat(file, &info) == 0 && (size_t) info.st_size >= sizeof(Header))
+			mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_SHARED, file, 0);
+		close(file);
+		if (mapping == MAP_FAILED)
+			return false;
+
+		const Header *header = (const Header *) mapping;
+		bool valid = memcmp(header->magic, recorderMagic, sizeof(recorderMagic)) == 0
+			&& header->slotCount != 0 && header->slotSize > sizeof(Slot)
+			&& sizeof(Header) + (uint64_t) header->slotCount * header->slotSize <= (uint64_t) info.st_size;
+		if (valid)
+			DumpRing(header, fd);
+		munmap(mapping, (size_t) info.st_size);
+		return valid;
+#else
+		(void) path;
+		(void) fd;
+		return false;
+#endif
+	}
+
+	//Each handler disarms the other before dumping, so a crash is only dumped once even
+	//when terminate's abort() lands in the SIGABRT handler
+	static void OnFatalSignal(int signal)
+	{
+		FlightRecorder *recorder = crashRecorder.exchange(nullptr);
+		if (recorder != nullptr)
+			recorder->Dump(STDERR_FILENO);
+
+		//The handler was installed one-shot, so this gets the default action (and a core dump)
+		raise(signal);
+	}
+
+	static void OnTerminate()
+	{
+		FlightRecorder *recorder = crashRecorder.exchange(nullptr);
+		if (recorder != nullptr)
+			recorder->Dump(STDERR_FILENO);
+
+		if (previousTerminate != nullptr)
+			previousTerminate();
+		abort();
+	}
+
+	void FlightRecorder::InstallCrashHandlers()
+	{
+		static const int fatalSignals[] = { SIGSEGV, SIGILL, SIGFPE, SIGABRT,
+#ifndef _WIN32
+			SIGBUS,
+#endif
+		};
+
+		if (crashRecorder.exchange(this) != nullptr)
+			return;
+
+#ifndef _WIN32
+		//Give this thread somewhere to run the handler when the crash is a stack overflow
+		static char alternateStack[64 * 1024];
+		stack_t stack = {};
+		stack.ss_sp = alternateStack;
+		stack.ss_size = sizeof(alternateStack);
+		sigaltstack(&stack, nullptr);
+
+		struct sigaction action = {};
+		action.sa_handler = OnFatalSignal;
+		action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+		sigemptyset(&action.sa_mask);
+		for (size_t i = 0; i < sizeof(fatalSignals) / sizeof(fatalSignals[0]); ++i)
+			sigaction(fatalSignals[i], &action, nullptr);
+#else
+		for (size_t i = 0; i < sizeof(fatalSignals) / sizeof(fatalSignals[0]); ++i)
+			signal(fatalSignals[i], OnFatalSignal);
+#endif
+
+		previousTerminate = set_terminate(OnTerminate);
+	}
+}
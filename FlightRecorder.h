@@ -0,0 +1,75 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+#include <stdint.h>
+
+/* Flight recorder
+ * Keeps the most recent records in a fixed ring of equally-sized slots so they
+ * can be recovered after a crash. Register it at Debug to capture everything
+ * regardless of what the other destinations are set to:
+ *   static FlightRecorder recorder(4096, 256, "/var/tmp/myapp.flight");
+ *   logger.AddLogDestination(recorder, Debug);
+ *   recorder.InstallCrashHandlers();
+ * Recording a line is a single atomic increment plus a bounded memcpy, and
+ * records longer than a slot are truncated.
+ *
+ * When a path is given the ring lives in a MAP_SHARED file, so the kernel keeps
+ * its contents even if the process dies without running any handlers. The file
+ * is a Header followed by slotCount slots of slotSize bytes; each slot starts
+ * with a Slot and is followed by the record text. FlightRecorder::Dump(path, fd)
+ * (and tools/flightdump) read such a file back. A recording left at the path
+ * by an earlier run is renamed to path.1 rather than overwritten.
+*/
+
+namespace neosmart
+{
+	class FlightRecorder : public LogSink
+	{
+	public:
+		struct Header
+		{
+			char magic[8];
+			uint32_t slotSize;
+			uint32_t slotCount;
+			std::atomic<uint64_t> next;
+		};
+
+		struct Slot
+		{
+			//Ticket + 1 once the text is complete, 0 while it is being written
+			std::atomic<uint64_t> sequence;
+			uint32_t length;
+			uint32_t level;
+		};
+
+	private:
+		Header *_header;
+		size_t _size;
+		bool _mapped;
+
+		static void DumpRing(const Header *header, int fd);
+
+	public:
+		FlightRecorder(size_t records = 1024, size_t recordSize = 256, const char *path = nullptr);
+		~FlightRecorder();
+
+		virtual void Write(const LogRecord &record);
+
+		//Whether the ring is backed by the file passed to the constructor
+		bool IsMapped() const { return _mapped; }
+
+		//Writes the recorded lines, oldest first. Async-signal-safe.
+		void Dump(int fd) const;
+		static bool Dump(const char *path, int fd);
+
+		//Dump this recorder to stderr on fatal signals and std::terminate
+		void InstallCrashHandlers();
+	};
+}
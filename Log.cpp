@@ -6,52 +6,420 @@
 */
 
 #include "Log.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <condition_variable>
+#include <climits>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
 
 using namespace neosmart;
 using namespace std;
 
 namespace neosmart
 {
-	__thread int IndentLevel = -1;
+	__thread LogContext ThreadLogContext;
+	__thread LogContext *ActiveLogContext = nullptr;
+	__thread uint32_t ThreadId = 0;
+	__thread char ThreadName[16];
+	__thread uint64_t ThreadSequence = 0;
 
-	static Logger &instance() {
-		static Logger defaultLogger{LogLevel::Debug};
-		return defaultLogger;
+	uint32_t LookupThreadId()
+	{
+#if defined(_WIN32)
+		return (uint32_t) GetCurrentThreadId();
+#elif defined(__linux__)
+		return (uint32_t) syscall(SYS_gettid);
+#else
+		return (uint32_t)(uintptr_t) pthread_self();
+#endif
 	}
 
-	Logger &Logger::GlobalLogger() {
-		static std::once_flag flag;
-		std::call_once(flag, [] { instance(); });
-		return instance();
+	void LogContext::SetRequestId(const char *id)
+	{
+		snprintf(requestId, sizeof(requestId), "%s", id != nullptr ? id : "");
 	}
 
-	Logger::Logger(LogLevel logLevel)
+	const char *CurrentThreadName()
 	{
-		_logLevel = logLevel;
-#if defined(_WIN32) && defined(UNICODE)
-		_defaultLog = &std::wcerr;
+		if (ThreadName[0] == '\0')
+		{
+#if defined(__linux__)
+			if (pthread_getname_np(pthread_self(), ThreadName, sizeof(ThreadName)) != 0 || ThreadName[0] == '\0')
+#endif
+				snprintf(ThreadName, sizeof(ThreadName), "%u", CurrentThreadId());
+		}
+		return ThreadName;
+	}
+
+	void SetThreadName(const char *name)
+	{
+		snprintf(ThreadName, sizeof(ThreadName), "%s", name);
+#if defined(__linux__)
+		pthread_setname_np(pthread_self(), ThreadName);
+#endif
+	}
+
+	int CurrentCpu()
+	{
+#if defined(_WIN32)
+		return (int) GetCurrentProcessorNumber();
+#elif defined(__linux__)
+		return sched_getcpu();
 #else
-		_defaultLog = &std::cerr;
+		return -1;
 #endif
-		AddLogDestination(*_defaultLog, logLevel);
 	}
 
-	void Logger::Broadcast(LogLevel level, LPCTSTR message)
+	//Configured loggers, for the fork and exit handlers
+	static mutex loggerLock;
+	static vector<Logger*> loggers;
+
+	NST_CONSTINIT ImmortalLogger globalLogger(neosmart::Debug);
+
+	Logger &Logger::GlobalLogger() {
+		return globalLogger.logger;
+	}
+
+	Logger::~Logger()
 	{
-		for(map<ostream*, LogLevel>::iterator i = _outputs.begin(); i != _outputs.end(); ++i)
+		StopWatching();
+		if (_tracked)
 		{
-			if(level < i->second)
-				continue;
-			(*i->first) << message;
+			lock_guard<mutex> lock(loggerLock);
+			loggers.erase(std::remove(loggers.begin(), loggers.end(), this), loggers.end());
+		}
+		delete _outputs.load();
+	}
+
+	//Indentation only works if ScopeLog is printing. The prefix is right-aligned
+	//in depth + 3 columns, as "%*s" would.
+	size_t Logger::Indentation(const LogContext &context, size_t prefix) const
+	{
+		if (context.scopes.depth <= 0 || _logLevel.load(memory_order_relaxed) > neosmart::Debug)
+			return 0;
+		return (size_t)context.scopes.depth + 3 > prefix ? (size_t)context.scopes.depth + 3 - prefix : 0;
+	}
+
+	static TCHAR *WriteText(TCHAR *out, const char *text, bool escape)
+	{
+		for (const char *c = text; *c != '\0'; ++c)
+		{
+			if (*c == '%' && escape)
+				*out++ = _T('%');
+			*out++ = (TCHAR)(unsigned char) *c;
+		}
+		return out;
+	}
+
+	//Writes the enabled record fields, at most 113 characters (169 if escaped)
+	TCHAR *Logger::WriteFields(TCHAR *out, const LogContext &context, unsigned fields, int cpu, uint64_t sequence, bool escape)
+	{
+		if ((fields & LogRequestId) && context.requestId[0] == '\0')
+			fields &= ~LogRequestId;
+		if ((fields & (LogThreadId | LogThreadName | LogCpu | LogRequestId | LogSequence)) == 0)
+			return out;
+
+		TCHAR number[32];
+		TCHAR *start = out;
+		*out++ = _T('[');
+		if (fields & LogThreadId)
+		{
+			_stprintf_s(number, 32, _T("%u"), CurrentThreadId());
+			out = copy(number, number + _tcsclen(number), out);
+		}
+		if (fields & LogThreadName)
+		{
+			if (out != start + 1)
+				*out++ = _T(' ');
+			out = WriteText(out, CurrentThreadName(), escape);
+		}
+		if (fields & LogCpu)
+		{
+			if (out != start + 1)
+				*out++ = _T(' ');
+			_stprintf_s(number, 32, _T("cpu%d"), cpu);
+			out = copy(number, number + _tcsclen(number), out);
+		}
+		if (fields & LogRequestId)
+		{
+			if (out != start + 1)
+				*out++ = _T(' ');
+			out = copy_n(_T("req="), 4, out);
+			out = WriteText(out, context.requestId, escape);
 		}
+		if (fields & LogSequence)
+		{
+			if (out != start + 1)
+				*out++ = _T(' ');
+			_stprintf_s(number, 32, _T("seq=%llu"), (unsigned long long) sequence);
+			out = copy(number, number + _tcsclen(number), out);
+		}
+		*out++ = _T(']');
+		*out++ = _T(' ');
+		return out;
+	}
+
+	//Builds the format string for a record: indentation, level prefix, fields,
+	//message, breadcrumbs if enabled and the line ending
+	TCHAR *Logger::BuildMask(LogArena &arena, const LogContext &context, LogLevel level, const LogMessage &message, unsigned fields, int cpu, uint64_t sequence)
+	{
+		const ScopeStack &scopes = context.scopes;
+		size_t prefix = _tcsclen(logPrefixes[level]);
+		size_t indent = Indentation(context, prefix);
+
+		bool breadcrumbs = (level == neosmart::Warn || level == neosmart::Error) && scopes.depth > 0 &&
+			_breadcrumbs.load(memory_order_relaxed);
+		int named = min(scopes.depth, (int) ScopeStack::Capacity);
+		size_t trail = 0;
+		if (breadcrumbs)
+		{
+			//Every character may need escaping, plus separators, brackets and " > ..."
+			trail = 5 + 1 + 6;
+			for (int i = 0; i < named; ++i)
+				trail += 2 * _tcsclen(scopes.names[i]) + 3;
+		}
+
+		size_t size = indent + prefix + 169 + message.length + trail + 2 + 1;
+		TCHAR *mask = (TCHAR *) arena.mask.Reserve(size * sizeof(TCHAR));
+		TCHAR *end = fill_n(mask, indent, _T(' '));
+		end = copy_n(logPrefixes[level], prefix, end);
+		end = WriteFields(end, context, fields, cpu, sequence, true);
+		end = copy_n(message.data, message.length, end);
+		if (breadcrumbs)
+		{
+			end = copy_n(_T(" [in "), 5, end);
+			for (int i = 0; i < named; ++i)
+			{
+				if (i != 0)
+					end = copy_n(_T(" > "), 3, end);
+				//Names end up in the format string, so escape any conversions
+				for (LPCTSTR c = scopes.names[i]; *c != _T('\0'); ++c)
+				{
+					if (*c == _T('%'))
+						*end++ = _T('%');
+					*end++ = *c;
+				}
+			}
+			if (scopes.depth > named)
+				end = copy_n(_T(" > ..."), 6, end);
+			*end++ = _T(']');
+		}
+		*end++ = _T('\r');
+		*end++ = _T('\n');
+		*end = _T('\0');
+		return mask;
+	}
+
+	//The same text ScopeLog used to log through Log(), without going through the formatter
+	void Logger::EmitScopeEvent(bool entering, LPCTSTR name)
+	{
+		LPCTSTR action = entering ? _T("Entering ") : _T("Leaving ");
+		const LogContext &context = CurrentLogContext();
+		size_t prefix = _tcsclen(logPrefixes[neosmart::Debug]);
+		size_t indent = Indentation(context, prefix);
+		size_t actionLength = _tcsclen(action);
+		size_t nameLength = _tcsclen(name);
+
+		unsigned fields = _fields.load(memory_order_relaxed);
+		int cpu = (fields & LogCpu) ? CurrentCpu() : -1;
+		uint64_t sequence = NextSequence();
+
+		LogArena::Lease arena;
+		size_t size = indent + prefix + 113 + actionLength + nameLength + 2;
+		TCHAR *text = (TCHAR *) arena->record.Reserve(size * sizeof(TCHAR));
+		TCHAR *end = fill_n(text, indent, _T(' '));
+		end = copy_n(logPrefixes[neosmart::Debug], prefix, end);
+		end = WriteFields(end, context, fields, cpu, sequence, false);
+		end = copy_n(action, actionLength, end);
+		end = copy_n(name, nameLength, end);
+		*end++ = _T('\r');
+		*end++ = _T('\n');
+
+		LogRecord record = { neosmart::Debug, text, (size_t)(end - text), nullptr, nullptr, 0, nullptr, 0, CurrentThreadId(), cpu, 0, sequence };
+		Broadcast(record);
+	}
+
+	void Logger::SetScopeEvents(bool enabled)
+	{
+		_scopeEvents = enabled;
+	}
+
+	void Logger::SetBreadcrumbs(bool enabled)
+	{
+		_breadcrumbs = enabled;
+	}
+
+	void Logger::SetRecordFields(unsigned fields)
+	{
+		_fields = fields;
+	}
+
+	void Logger::Broadcast(const LogRecord &record)
+	{
+		//Hold a reference so a concurrent reconfiguration can't pull the table out from under us
+		shared_ptr<const Destinations> outputs = Current();
+		if (!outputs)
+		{
+			if (record.level >= _logLevel.load(memory_order_relaxed))
+				_defaultSink.Write(record);
+			return;
+		}
+		for(vector<Destination>::const_iterator i = outputs->outputs.begin(); i != outputs->outputs.end() && record.level >= i->level; ++i)
+			i->sink->Write(record);
+	}
+
+	void Logger::Broadcast(const LogRecord *records, size_t count)
+	{
+		shared_ptr<const Destinations> outputs = Current();
+		if (!outputs)
+		{
+			if (records[0].level >= _logLevel.load(memory_order_relaxed))
+				_defaultSink.WriteBatch(records, count);
+			return;
+		}
+		for(vector<Destination>::const_iterator i = outputs->outputs.begin(); i != outputs->outputs.end() && records[0].level >= i->level; ++i)
+			i->sink->WriteBatch(records, count);
+	}
+
+	shared_ptr<const Logger::Destinations> Logger::Current() const
+	{
+		//Counted against the epoch we started in; see Install()
+		unsigned epoch = _epoch.load() & 1;
+		_readers[epoch].fetch_add(1);
+		shared_ptr<const Destinations> *outputs = _outputs.load();
+		shared_ptr<const Destinations> current = outputs != nullptr ? *outputs : shared_ptr<const Destinations>();
+		_readers[epoch].fetch_sub(1, memory_order_release);
+		return current;
+	}
+
+	//Must be called with _configLock held. A reader may have read the epoch before the
+	//swap and only be counted after it, so both halves are waited out in turn; by then
+	//every reader still counted has seen the new table.
+	void Logger::Install(shared_ptr<const Destinations> outputs)
+	{
+		shared_ptr<const Destinations> *previous = _outputs.exchange(new shared_ptr<const Destinations>(move(outputs)));
+		if (previous == nullptr)
+			return;
+		for (int i = 0; i < 2; ++i)
+		{
+			unsigned epoch = _epoch.fetch_add(1) & 1;
+			while (_readers[epoch].load(memory_order_acquire) != 0)
+				this_thread::yield();
+		}
+		//The table itself is released by whoever holds it last
+		delete previous;
+	}
+
+	//Must be called with _configLock held. Spells out the default destination table
+	//the first time the destinations are changed.
+	const Logger::Destinations &Logger::Configured()
+	{
+		if (_outputs.load() == nullptr)
+		{
+			shared_ptr<Destinations> outputs = make_shared<Destinations>();
+			//The default sink is a member, so the table doesn't own it
+			outputs->streams[_defaultLog] = shared_ptr<LogSink>(shared_ptr<LogSink>(), &_defaultSink);
+			outputs->SetLevel(&_defaultSink, _logLevel);
+			Install(outputs);
+		}
+		return **_outputs.load();
+	}
+
+	//Must be called with _configLock held
+	Logger::Settings &Logger::ConfiguredSettings()
+	{
+		if (!_settings)
+			_settings.reset(new Settings());
+		return *_settings;
+	}
+
+	//Must be called with _configLock held
+	void Logger::Publish(shared_ptr<const Destinations> outputs)
+	{
+		if (!_tracked)
+		{
+			static once_flag handlers;
+			call_once(handlers, [] {
+#ifndef _WIN32
+				pthread_atfork(&Logger::PrepareFork, &Logger::AfterForkInParent, &Logger::AfterForkInChild);
+#endif
+				atexit(&Logger::FlushAtExit);
+				at_quick_exit(&Logger::FlushAtExit);
+			});
+			lock_guard<mutex> lock(loggerLock);
+			loggers.push_back(this);
+			_tracked = true;
+		}
+
+		LogLevel threshold = outputs->outputs.empty() ? None : outputs->outputs.front().level;
+		bool arguments = false;
+		for (vector<Destination>::const_iterator i = outputs->outputs.begin(); i != outputs->outputs.end() && !arguments; ++i)
+			arguments = i->sink->UsesArguments();
+		//A record logged while this changes just goes without its arguments
+		_arguments = arguments;
+
+		//Lower the threshold before installing a more verbose table and raise it after a
+		//less verbose one, so a record is never skipped while it still has a listener.
+		if (threshold < _threshold.load())
+			_threshold = threshold;
+		Install(move(outputs));
+		_threshold = threshold;
+	}
+
+	void Logger::Destinations::SetLevel(LogSink *sink, LogLevel level)
+	{
+		Remove(sink);
+		//After any others at the same level, so destinations keep the order they were added in
+		Destination destination = { sink, level };
+		outputs.insert(upper_bound(outputs.begin(), outputs.end(), destination,
+			[](const Destination &a, const Destination &b) { return a.level < b.level; }), destination);
+	}
+
+	void Logger::Destinations::Remove(LogSink *sink)
+	{
+		for (vector<Destination>::iterator i = outputs.begin(); i != outputs.end(); ++i)
+		{
+			if (i->sink == sink)
+			{
+				outputs.erase(i);
+				return;
+			}
+		}
+	}
+
+	void Logger::Destinations::SetStreamLevel(neosmart::ostream *stream, LogLevel level)
+	{
+		shared_ptr<LogSink> &sink = streams[stream];
+		if (!sink)
+			sink = make_shared<StreamSink>(*stream);
+		SetLevel(sink.get(), level);
 	}
 
 	void Logger::SetLogLevel(LogLevel logLevel)
 	{
-		const auto &defaultLogPair = _outputs.find(_defaultLog);
-		if (defaultLogPair != _outputs.end())
-			defaultLogPair->second = logLevel;
+		lock_guard<mutex> lock(_configLock);
 		_logLevel = logLevel;
+		const Destinations &current = Configured();
+		if (current.streams.find(_defaultLog) == current.streams.end())
+			return;
+
+		shared_ptr<Destinations> outputs = make_shared<Destinations>(current);
+		outputs->SetStreamLevel(_defaultLog, logLevel);
+		Publish(outputs);
 	}
 
 	void Logger::AddLogDestination(neosmart::ostream &destination)
@@ -61,19 +429,803 @@ namespace neosmart
 
 	void Logger::AddLogDestination(neosmart::ostream &destination, LogLevel level)
 	{
-		_outputs[&destination] = level;
+		lock_guard<mutex> lock(_configLock);
+		shared_ptr<Destinations> outputs = make_shared<Destinations>(Configured());
+		outputs->SetStreamLevel(&destination, level);
+		Publish(outputs);
+	}
+
+	void Logger::AddLogDestination(LogSink &destination)
+	{
+		return AddLogDestination(destination, _logLevel);
+	}
+
+	void Logger::AddLogDestination(LogSink &destination, LogLevel level)
+	{
+		lock_guard<mutex> lock(_configLock);
+		shared_ptr<Destinations> outputs = make_shared<Destinations>(Configured());
+		outputs->SetLevel(&destination, level);
+		Publish(outputs);
+	}
+
+	void Logger::RemoveLogDestination(LogSink &destination)
+	{
+		lock_guard<mutex> lock(_configLock);
+		shared_ptr<Destinations> outputs = make_shared<Destinations>(Configured());
+		outputs->Remove(&destination);
+		Publish(outputs);
 	}
 
 	void Logger::ClearLogDestinations()
 	{
-		_outputs.clear();
+		lock_guard<mutex> lock(_configLock);
+		Publish(make_shared<Destinations>());
+	}
+
+	void Logger::Flush()
+	{
+		shared_ptr<const Destinations> outputs = Current();
+		if (!outputs)
+		{
+			_defaultSink.Flush();
+			return;
+		}
+		for(vector<Destination>::const_iterator i = outputs->outputs.begin(); i != outputs->outputs.end(); ++i)
+			i->sink->Flush();
+	}
+
+	void StreamSink::Write(const LogRecord &record)
+	{
+		_output.write(record.message, record.length);
+	}
+
+	void StreamSink::WriteBatch(const LogRecord *records, size_t count)
+	{
+		//Adjacent records go out in one write
+		for (size_t first = 0, last; first < count; first = last)
+		{
+			size_t length = records[first].length;
+			for (last = first + 1; last < count && records[last].message == records[first].message + length; ++last)
+				length += records[last].length;
+			_output.write(records[first].message, length);
+		}
+	}
+
+	void StreamSink::Flush()
+	{
+		_output.flush();
+	}
+
+	static atomic<size_t> arenaFootprint(0);
+
+	LogBuffer::LogBuffer()
+		: _data(nullptr), _capacity(0)
+	{
+		setp(nullptr, nullptr);
+	}
+
+	LogBuffer::~LogBuffer()
+	{
+		arenaFootprint -= _capacity;
+		free(_data);
+		_data = nullptr;
+		_capacity = 0;
+		setp(nullptr, nullptr);
+	}
+
+	bool LogBuffer::Grow(size_t capacity)
+	{
+		size_t length = Length();
+		if (capacity <= _capacity)
+			return true;
+		capacity = max(capacity, _capacity * 2);
+
+		char *data = (char *) realloc(_data, capacity);
+		if (data == nullptr)
+			return false;
+		arenaFootprint += capacity - _capacity;
+		_data = data;
+		_capacity = capacity;
+		setp(_data, _data + _capacity);
+		pbump((int) length);
+		return true;
+	}
+
+	LogBuffer::int_type LogBuffer::overflow(int_type c)
+	{
+		if (traits_type::eq_int_type(c, traits_type::eof()))
+			return traits_type::not_eof(c);
+		if (!Grow(_capacity + 1))
+			return traits_type::eof();
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+		return c;
+	}
+
+	streamsize LogBuffer::xsputn(const char *s, streamsize count)
+	{
+		if ((size_t)(epptr() - pptr()) < (size_t) count && !Grow(Length() + (size_t) count))
+			return 0;
+		memcpy(pptr(), s, (size_t) count);
+		pbump((int) count);
+		return count;
+	}
+
+	char *LogBuffer::Reserve(size_t size)
+	{
+		Clear();
+		if (!Grow(size))
+			throw bad_alloc();
+		return _data;
+	}
+
+	void LogBuffer::Trim(size_t limit)
+	{
+		if (_capacity <= limit)
+			return;
+		arenaFootprint -= _capacity;
+		free(_data);
+		_data = nullptr;
+		_capacity = 0;
+		setp(nullptr, nullptr);
+	}
+
+	LogArena::LogArena()
+		: _busy(false), formatter(&record)
+	{
+	}
+
+	size_t LogArena::Footprint()
+	{
+		return arenaFootprint.load(memory_order_relaxed);
+	}
+
+	//Set once the thread's arena is destroyed. Records logged after that, from
+	//later static or thread_local destructors, get a temporary arena.
+	static __thread bool arenaDestroyed = false;
+
+	struct ArenaOwner
+	{
+		LogArena arena;
+
+		~ArenaOwner()
+		{
+			arenaDestroyed = true;
+		}
+	};
+
+	LogArena::Lease::Lease()
+	{
+		static thread_local ArenaOwner owner;
+		if (!arenaDestroyed && !owner.arena._busy)
+			_arena = &owner.arena;
+		else
+		{
+			_temporary.reset(new LogArena());
+			_arena = _temporary.get();
+		}
+		_arena->_busy = true;
+
+		//A failed write would otherwise leave the stream unusable for later records
+		_arena->formatter.stream().clear();
+	}
+
+	LogArena::Lease::~Lease()
+	{
+		_arena->_busy = false;
+		_arena->mask.Trim(RetainedSize);
+		_arena->record.Trim(RetainedSize);
+	}
+
+	LogBatch::LogBatch(Logger &logger, LogLevel level, const LogMessage &message)
+		: _logger(logger), _level(level), _fields(0)
+	{
+		assert(level >= neosmart::Debug && level <= neosmart::Passthru);
+		_enabled = level >= logger._threshold.load(memory_order_relaxed);
+		if (!_enabled)
+			return;
+
+		_fields = logger._fields.load(memory_order_relaxed);
+		_cpu = (_fields & LogCpu) ? CurrentCpu() : -1;
+		if (_fields & LogSequence)
+			_format.assign(message.data, message.length);
+		else
+			_mask = logger.BuildMask(_arena, CurrentLogContext(), level, message, _fields, _cpu, 0);
+		_arena.record.Clear();
+	}
+
+	LogBatch::~LogBatch()
+	{
+		Commit();
+	}
+
+	void LogBatch::Commit()
+	{
+		if (_ends.empty())
+			return;
+
+		const LogContext &context = CurrentLogContext();
+		vector<LogRecord> records(_ends.size());
+		LPCTSTR text = (LPCTSTR) _arena.record.Data();
+		size_t start = 0;
+		for (size_t i = 0; i < _ends.size(); ++i)
+		{
+			LogRecord record = { _level, text + start, _ends[i] - start, nullptr, nullptr, 0, nullptr, 0, CurrentThreadId(), _cpu, 0, _sequences[i] };
+			if (_level == neosmart::Warn || _level == neosmart::Error)
+			{
+				record.scopes = context.scopes.names;
+				record.scopeCount = (size_t) min(context.scopes.depth, (int) ScopeStack::Capacity);
+			}
+			records[i] = record;
+			start = _ends[i];
+		}
+		_logger.Broadcast(&records[0], records.size());
+
+		_ends.clear();
+		_sequences.clear();
+		_arena.record.Clear();
+		_arena.record.Trim(CommitSize * 2);
+	}
+
+	static bool ParseLogLevel(const string &name, LogLevel &level)
+	{
+		static const char *names[] = { "debug", "info", "warn", "error", "passthru", "none" };
+		string lower;
+		for (size_t i = 0; i < name.size(); ++i)
+			lower += (char) tolower((unsigned char) name[i]);
+		for (int i = Debug; i <= None; ++i)
+		{
+			if (lower == names[i])
+			{
+				level = (LogLevel) i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool Logger::LoadConfiguration(const char *path)
+	{
+		ifstream file(path);
+		if (!file)
+			return false;
+
+		LogLevel logLevel = _logLevel;
+		map<string, LogLevel> moduleLevels;
+		vector<pair<string, string>> outputs;
+
+		string line;
+		for (int lineNumber = 1; getline(file, line); ++lineNumber)
+		{
+			size_t start = line.find_first_not_of(" \t\r");
+			if (start == string::npos || line[start] == '#')
+				continue;
+
+			size_t equals = line.find('=');
+			if (equals == string::npos)
+			{
+				Warn(_T("%s:%d: expected key = value"), path, lineNumber);
+				return false;
+			}
+
+			string key, value, extra;
+			istringstream(line.substr(0, equals)) >> key;
+			istringstream(line.substr(equals + 1)) >> value >> extra;
+
+			if (key == "level" && ParseLogLevel(value, logLevel) && extra.empty())
+				continue;
+			if (key.compare(0, 7, "module.") == 0 && key.size() > 7 && extra.empty()
+				&& ParseLogLevel(value, moduleLevels[key.substr(7)]))
+				continue;
+			if (key == "output" && !value.empty())
+			{
+				outputs.push_back(make_pair(value, extra));
+				continue;
+			}
+
+			Warn(_T("%s:%d: invalid setting %s"), path, lineNumber, line.c_str());
+			return false;
+		}
+
+		//Open every new destination before touching the live configuration so that a
+		//bad path leaves the logger exactly as it was.
+		shared_ptr<Destinations> streams;
+		if (!outputs.empty())
+		{
+			streams = make_shared<Destinations>();
+			for (size_t i = 0; i < outputs.size(); ++i)
+			{
+				LogLevel level = logLevel;
+				if (!outputs[i].second.empty() && !ParseLogLevel(outputs[i].second, level))
+				{
+					Warn(_T("%s: invalid level for output %s"), path, outputs[i].first.c_str());
+					return false;
+				}
+
+				ostream *destination;
+				if (outputs[i].first == "stderr")
+					destination = _defaultLog;
+				else if (outputs[i].first == "stdout")
+				{
+#if defined(_WIN32) && defined(UNICODE)
+					destination = &std::wcout;
+#else
+					destination = &std::cout;
+#endif
+				}
+				else
+				{
+					shared_ptr<basic_ofstream<TCHAR>> stream = make_shared<basic_ofstream<TCHAR>>(outputs[i].first.c_str(), ios::app);
+					if (!*stream)
+					{
+						Warn(_T("%s: unable to open output %s"), path, outputs[i].first.c_str());
+						return false;
+					}
+					streams->owned.push_back(stream);
+					destination = stream.get();
+				}
+				streams->SetStreamLevel(destination, level);
+			}
+		}
+
+		lock_guard<mutex> lock(_configLock);
+		_logLevel = logLevel;
+		const Destinations &current = Configured();
+		if (streams)
+		{
+			//Swap out the stream destinations but keep any sinks registered in code
+			shared_ptr<Destinations> destinations = make_shared<Destinations>(*streams);
+			for(vector<Destination>::const_iterator i = current.outputs.begin(); i != current.outputs.end(); ++i)
+			{
+				bool isStream = false;
+				for(map<ostream*, shared_ptr<LogSink>>::const_iterator j = current.streams.begin(); j != current.streams.end() && !isStream; ++j)
+					isStream = j->second.get() == i->sink;
+				if (!isStream)
+					destinations->SetLevel(i->sink, i->level);
+			}
+			Publish(destinations);
+		}
+		else if (current.streams.find(_defaultLog) != current.streams.end())
+		{
+			shared_ptr<Destinations> destinations = make_shared<Destinations>(current);
+			destinations->SetStreamLevel(_defaultLog, logLevel);
+			Publish(destinations);
+		}
+
+		//Modules that were configured by the previous file but not this one go back to
+		//deferring to the logger's destinations.
+		Settings &settings = ConfiguredSettings();
+		for (size_t i = 0; i < settings.modules.size(); ++i)
+		{
+			LogModule *module = settings.modules[i];
+			map<string, LogLevel>::const_iterator level = moduleLevels.find(module->_name);
+			if (level != moduleLevels.end())
+				module->_logLevel = level->second;
+			else if (settings.moduleLevels.find(module->_name) != settings.moduleLevels.end())
+				module->_logLevel = neosmart::Debug;
+		}
+		settings.moduleLevels.swap(moduleLevels);
+
+		return true;
+	}
+
+	bool Logger::WatchConfiguration(const char *path)
+	{
+		StopWatching();
+
+		//Start watching before the initial load so that no rewrite can slip in between
+		int notifier = -1;
+#ifdef __linux__
+		//Watch the directory rather than the file, since editors and deployment tools
+		//usually replace the file with a rename rather than rewriting it in place.
+		const char *slash = strrchr(path, '/');
+		string directory = slash == nullptr ? "." : string(path, slash + 1);
+		notifier = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (notifier >= 0 && inotify_add_watch(notifier, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+		{
+			close(notifier);
+			notifier = -1;
+		}
+#endif
+
+		bool loaded = LoadConfiguration(path);
+		_watching = true;
+		lock_guard<mutex> lock(_configLock);
+		ConfiguredSettings().watcher = thread(&Logger::WatchLoop, this, string(path), notifier);
+		return loaded;
+	}
+
+	void Logger::StopWatching()
+	{
+		_watching = false;
+		thread watcher;
+		{
+			lock_guard<mutex> lock(_configLock);
+			if (_settings)
+				watcher.swap(_settings->watcher);
+		}
+		if (watcher.joinable())
+			watcher.join();
+	}
+
+	void Logger::WatchLoop(string path, int notifier)
+	{
+		//How long to wait before noticing StopWatching(); changes themselves are picked up
+		//as soon as inotify reports them.
+		const int interval = 200;
+
+#ifdef __linux__
+		if (notifier >= 0)
+		{
+			size_t slash = path.rfind('/');
+			string name = slash == string::npos ? path : path.substr(slash + 1);
+
+			alignas(inotify_event) char buffer[4096];
+			while (_watching)
+			{
+				pollfd pfd = { notifier, POLLIN, 0 };
+				if (poll(&pfd, 1, interval) <= 0)
+					continue;
+
+				bool changed = false;
+				ssize_t length;
+				while ((length = read(notifier, buffer, sizeof(buffer))) > 0)
+				{
+					for (char *p = buffer; p < buffer + length; )
+					{
+						inotify_event *event = (inotify_event *) p;
+						if (event->len != 0 && name == event->name)
+							changed = true;
+						p += sizeof(inotify_event) + event->len;
+					}
+				}
+				if (changed)
+					LoadConfiguration(path.c_str());
+			}
+			close(notifier);
+			return;
+		}
+#endif
+
+		//No change notifications available, fall back to polling the modification time
+		struct stat info;
+		time_t lastModified = stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+		while (_watching)
+		{
+			this_thread::sleep_for(chrono::milliseconds(interval));
+			if (stat(path.c_str(), &info) == 0 && info.st_mtime != lastModified)
+			{
+				lastModified = info.st_mtime;
+				LoadConfiguration(path.c_str());
+			}
+		}
+	}
+
+	static mutex siteLock;
+	static vector<const LogSite*> sites;
+
+	static bool IsDigit(TCHAR c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	//Walks the format string the way tinyformat does
+	void FindConversions(LPCTSTR format, LogConversion *conversions, size_t count)
+	{
+		size_t argument = 0;
+		for (LPCTSTR c = format; *c != '\0' && argument < count; ++c)
+		{
+			if (*c != '%')
+				continue;
+			if (*++c == '%')
+				continue;
+
+			while (*c == '#' || *c == '0' || *c == '-' || *c == ' ' || *c == '+')
+				++c;
+			while (IsDigit(*c))
+				++c;
+			if (*c == '*')
+			{
+				conversions[argument++] = { '*', -1 };
+				++c;
+			}
+			int precision = -1;
+			if (*c == '.')
+			{
+				precision = 0;
+				if (*++c == '*')
+				{
+					if (argument < count)
+						conversions[argument++] = { '*', -1 };
+					precision = LogConversion::Variable;
+					++c;
+				}
+				else
+				{
+					//Negative precisions are ignored and count as zero
+					bool negative = *c == '-';
+					if (negative)
+						++c;
+					for (; IsDigit(*c); ++c)
+						precision = precision < INT_MAX / 10 ? precision * 10 + (*c - '0') : INT_MAX;
+					if (negative)
+						precision = 0;
+				}
+			}
+			while (*c == 'h' || *c == 'l' || *c == 'L' || *c == 'q' || *c == 'j' || *c == 'z' || *c == 't')
+				++c;
+			if (argument < count)
+				conversions[argument++] = { *c, precision };
+			if (*c == '\0')
+				break;
+		}
+		for (; argument < count; ++argument)
+			conversions[argument] = { '\0', -1 };
+	}
+
+	uint32_t LogSite::Register(LogSite &site)
+	{
+		lock_guard<mutex> lock(siteLock);
+		if (site.id.load(memory_order_relaxed) == 0)
+		{
+			sites.push_back(&site);
+			site.id.store((uint32_t) sites.size(), memory_order_release);
+		}
+		return site.id;
+	}
+
+	const LogSite *LogSite::Find(uint32_t id)
+	{
+		lock_guard<mutex> lock(siteLock);
+		return id != 0 && id <= sites.size() ? sites[id - 1] : nullptr;
+	}
+
+	//Counter blocks of running threads, plus the totals of threads that have exited.
+	//Records counted while a thread is exiting land in orphanCounters.
+	static mutex counterLock;
+	static vector<LogCounters*> liveCounters;
+	static uint64_t retiredLevels[Passthru + 1];
+	static vector<uint64_t> retiredSites;
+	static vector<uint64_t> retiredModules;
+	static NST_CONSTINIT LogCounters orphanCounters(true);
+	__thread LogCounters *ThreadCounters = nullptr;
+
+	static void AddChunks(const atomic<LogCounters::Chunk *> *table, size_t chunks, vector<uint64_t> &totals)
+	{
+		for (size_t i = 0; i < chunks; ++i)
+		{
+			const LogCounters::Chunk *chunk = table[i].load(memory_order_acquire);
+			if (chunk == nullptr)
+				continue;
+			if (totals.size() < (i + 1) * LogCounters::ChunkSize)
+				totals.resize((i + 1) * LogCounters::ChunkSize);
+			for (size_t j = 0; j < LogCounters::ChunkSize; ++j)
+				totals[i * LogCounters::ChunkSize + j] += chunk->counts[j].load(memory_order_relaxed);
+		}
+	}
+
+	static void AddCounters(const LogCounters &counters, uint64_t (&levels)[Passthru + 1], vector<uint64_t> &sites, vector<uint64_t> &modules)
+	{
+		for (int i = Debug; i <= Passthru; ++i)
+			levels[i] += counters.levels[i].load(memory_order_relaxed);
+		AddChunks(counters.sites, LogCounters::Chunks, sites);
+		AddChunks(counters.modules, LogCounters::ModuleChunks, modules);
+	}
+
+	//Folds an exiting thread's counts into the totals
+	struct CounterOwner
+	{
+		~CounterOwner()
+		{
+			LogCounters *counters = ThreadCounters;
+			ThreadCounters = &orphanCounters;
+			if (counters == nullptr || counters == &orphanCounters)
+				return;
+
+			lock_guard<mutex> lock(counterLock);
+			AddCounters(*counters, retiredLevels, retiredSites, retiredModules);
+			liveCounters.erase(std::remove(liveCounters.begin(), liveCounters.end(), counters), liveCounters.end());
+			for (size_t i = 0; i < LogCounters::Chunks; ++i)
+				delete counters->sites[i].load(memory_order_relaxed);
+			for (size_t i = 0; i < LogCounters::ModuleChunks; ++i)
+				delete counters->modules[i].load(memory_order_relaxed);
+			delete counters;
+		}
+	};
+	static thread_local CounterOwner counterOwner;
+
+	LogCounters *AttachCounters()
+	{
+		LogCounters *counters = new LogCounters();
+		{
+			lock_guard<mutex> lock(counterLock);
+			liveCounters.push_back(counters);
+		}
+		ThreadCounters = counters;
+		//Touching the owner registers its destructor for this thread
+		(void) &counterOwner;
+		return counters;
+	}
+
+	LogCounters::Chunk *LogCounters::AddChunk(atomic<Chunk *> *table, size_t chunk)
+	{
+		lock_guard<mutex> lock(counterLock);
+		Chunk *existing = table[chunk].load(memory_order_relaxed);
+		if (existing == nullptr)
+		{
+			existing = new Chunk();
+			table[chunk].store(existing, memory_order_release);
+		}
+		return existing;
+	}
+
+	void LogCounters::Collect(uint64_t (&levels)[Passthru + 1], vector<uint64_t> &sites, vector<uint64_t> &modules)
+	{
+		lock_guard<mutex> lock(counterLock);
+		copy(begin(retiredLevels), end(retiredLevels), levels);
+		sites = retiredSites;
+		modules = retiredModules;
+		for (size_t i = 0; i < liveCounters.size(); ++i)
+			AddCounters(*liveCounters[i], levels, sites, modules);
+		AddCounters(orphanCounters, levels, sites, modules);
+	}
+
+	//Destinations being held across a fork, each once even if several loggers share it
+	static vector<LogSink*> forkingSinks;
+
+	//Lock order: loggerLock, each logger's _configLock, the destinations, siteLock, counterLock
+	void Logger::PrepareFork()
+	{
+		loggerLock.lock();
+		for (size_t i = 0; i < loggers.size(); ++i)
+		{
+			loggers[i]->_configLock.lock();
+			const Destinations &destinations = loggers[i]->Configured();
+			for (size_t j = 0; j < destinations.outputs.size(); ++j)
+			{
+				LogSink *sink = destinations.outputs[j].sink;
+				if (find(forkingSinks.begin(), forkingSinks.end(), sink) == forkingSinks.end())
+					forkingSinks.push_back(sink);
+			}
+		}
+		for (size_t i = 0; i < forkingSinks.size(); ++i)
+			forkingSinks[i]->PrepareFork();
+		siteLock.lock();
+		counterLock.lock();
+	}
+
+	void Logger::AfterFork(bool child)
+	{
+		counterLock.unlock();
+		siteLock.unlock();
+		for (size_t i = forkingSinks.size(); i-- != 0; )
+			forkingSinks[i]->AfterFork(child);
+		forkingSinks.clear();
+		for (size_t i = loggers.size(); i-- != 0; )
+		{
+			Logger *logger = loggers[i];
+			//The watcher thread wasn't forked; forget it without joining
+			if (child && logger->_settings && logger->_settings->watcher.joinable())
+			{
+				logger->_watching = false;
+				new (&logger->_settings->watcher) thread();
+			}
+			//Threads caught reading the destinations weren't forked and will never leave
+			if (child)
+			{
+				logger->_readers[0] = 0;
+				logger->_readers[1] = 0;
+			}
+			logger->_configLock.unlock();
+		}
+		loggerLock.unlock();
+	}
+
+	void Logger::FlushAtExit()
+	{
+		{
+			lock_guard<mutex> lock(loggerLock);
+			for (size_t i = 0; i < loggers.size(); ++i)
+				loggers[i]->Flush();
+		}
+		//The global logger is never destroyed, so its watcher has to be stopped here
+		globalLogger.logger.StopWatching();
+	}
+
+	//The flush runs on a thread of its own so that a stuck destination can't hold up
+	//the caller past the deadline
+	bool Logger::Shutdown(chrono::milliseconds timeout)
+	{
+		StopWatching();
+		shared_ptr<const Destinations> outputs;
+		{
+			lock_guard<mutex> lock(_configLock);
+			Configured();
+			outputs = *_outputs.load();
+			Publish(make_shared<Destinations>());
+		}
+
+		struct Progress
+		{
+			mutex lock;
+			condition_variable finished;
+			bool done;
+		};
+		shared_ptr<Progress> progress = make_shared<Progress>();
+		progress->done = false;
+		thread([outputs, progress] {
+			for (size_t i = 0; i < outputs->outputs.size(); ++i)
+				outputs->outputs[i].sink->Flush();
+			lock_guard<mutex> lock(progress->lock);
+			progress->done = true;
+			progress->finished.notify_all();
+		}).detach();
+
+		unique_lock<mutex> lock(progress->lock);
+		return progress->finished.wait_for(lock, timeout, [&] { return progress->done; });
+	}
+
+	void Logger::Register(LogModule *module)
+	{
+		lock_guard<mutex> lock(_configLock);
+		Settings &settings = ConfiguredSettings();
+		settings.modules.push_back(module);
+		map<string, LogLevel>::const_iterator level = settings.moduleLevels.find(module->_name);
+		if (level != settings.moduleLevels.end())
+			module->_logLevel = level->second;
+	}
+
+	void Logger::Unregister(LogModule *module)
+	{
+		lock_guard<mutex> lock(_configLock);
+		Settings &settings = ConfiguredSettings();
+		settings.modules.erase(std::remove(settings.modules.begin(), settings.modules.end(), module), settings.modules.end());
+	}
+
+	//Module names by counter id - 1. Never shrinks, so counts outlive their modules.
+	static mutex moduleNameLock;
+	static vector<string> moduleNames;
+
+	static uint32_t ModuleCounter(const string &name)
+	{
+		lock_guard<mutex> lock(moduleNameLock);
+		auto found = std::find(moduleNames.begin(), moduleNames.end(), name);
+		if (found != moduleNames.end())
+			return (uint32_t)(found - moduleNames.begin()) + 1;
+		moduleNames.push_back(name);
+		return (uint32_t) moduleNames.size();
+	}
+
+	string LogModule::CounterName(uint32_t counter)
+	{
+		lock_guard<mutex> lock(moduleNameLock);
+		return counter != 0 && counter <= moduleNames.size() ? moduleNames[counter - 1] : string();
+	}
+
+	LogModule::LogModule(const char *name, Logger &logger)
+		: _logger(logger), _name(name), _logLevel(neosmart::Debug), _counter(ModuleCounter(_name))
+	{
+		_logger.Register(this);
+	}
+
+	LogModule::~LogModule()
+	{
+		_logger.Unregister(this);
+	}
+
+	void LogModule::SetLogLevel(LogLevel level)
+	{
+		_logLevel = level;
 	}
 
 	void ScopeLog::Initialize(LPCTSTR name)
 	{
 		_name = name;
-		++IndentLevel;
-		logger.Log(Debug, _T("Entering %s"), _name);
+		ScopeStack &scopes = CurrentLogContext().scopes;
+		if (scopes.depth < ScopeStack::Capacity)
+			scopes.names[scopes.depth] = name;
+		++scopes.depth;
+		logger.ScopeEvent(true, _name);
 	}
 
 	ScopeLog::ScopeLog(LPCTSTR name)
@@ -85,7 +1237,10 @@ namespace neosmart
 	void ScopeLog::Initialize(LPCSTR name)
 	{
 		_name = (LPCTSTR) name;
-		++IndentLevel;
+		ScopeStack &scopes = CurrentLogContext().scopes;
+		if (scopes.depth < ScopeStack::Capacity)
+			scopes.names[scopes.depth] = _name;
+		++scopes.depth;
 		logger.Log(Debug, _T("Entering %S"), _name);
 	}
 
@@ -97,7 +1252,7 @@ namespace neosmart
 
 	ScopeLog::~ScopeLog()
 	{
-		logger.Log(Debug, _T("Leaving %s"), _name);
-		--IndentLevel;
+		logger.ScopeEvent(false, _name);
+		--CurrentLogContext().scopes.depth;
 	}
 }
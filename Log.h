@@ -27,7 +27,16 @@ typedef char TCHAR;
 typedef const char *LPCTSTR;
 #endif
 
+#include <algorithm>
 #include <map>
+#include <vector>
+#include <string_view>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <iostream>
 #ifndef TINYFORMAT_USE_VARIADIC_TEMPLATES
 #define UNDEF_TINYFORMAT_USE_VARIADIC_TEMPLATES
@@ -37,6 +46,18 @@ typedef const char *LPCTSTR;
 #include "tinyformat.h"
 #include <cassert>
 
+//Requires an object to be constant-initialized, so it needs no code at startup
+//and is usable from any static initializer
+#if defined(__cpp_constinit)
+#define NST_CONSTINIT constinit
+#elif defined(__clang__)
+#define NST_CONSTINIT [[clang::require_constant_initialization]]
+#elif defined(__GNUC__) && __GNUC__ >= 10
+#define NST_CONSTINIT __constinit
+#else
+#define NST_CONSTINIT
+#endif
+
 /* Notes on synchronization
  * C++11 changes the behavior of cout and cerr, in particular:
 	* cerr is tied to cout, meaning cout will be flushed on calls to cerr
@@ -54,8 +75,100 @@ namespace neosmart
 	typedef std::ostream ostream;
 #endif
 
-	extern __thread int IndentLevel;
-	static LPCTSTR logPrefixes[] = { _T("DEBG: "), _T("INFO: "), _T("WARN: "), _T("ERRR: "), _T("") };
+	//Identity of the calling thread, filled in on first use by CurrentThreadId()
+	//and CurrentThreadName() so records can carry it without a syscall each
+	extern __thread uint32_t ThreadId;
+	extern __thread char ThreadName[16];
+
+	uint32_t LookupThreadId();
+	inline uint32_t CurrentThreadId()
+	{
+		if (ThreadId == 0)
+			ThreadId = LookupThreadId();
+		return ThreadId;
+	}
+	const char *CurrentThreadName();
+	//Numbers the calling thread's records 1, 2, 3..., see LogRecord::sequence
+	extern __thread uint64_t ThreadSequence;
+	inline uint64_t NextSequence()
+	{
+		return ++ThreadSequence;
+	}
+	//Names the calling thread for the logger and, where supported, the OS
+	void SetThreadName(const char *name);
+	//The CPU the caller is running on (sched_getcpu, served by rseq or the vDSO
+	//rather than a syscall), or -1 if it isn't known
+	int CurrentCpu();
+
+	//Optional fields rendered after the level prefix, see Logger::SetRecordFields()
+	enum LogField
+	{
+		LogThreadId = 1,
+		LogThreadName = 2,
+		LogCpu = 4,
+		LogRequestId = 8,
+		LogSequence = 16
+	};
+
+	//Names of the ScopeLog scopes a context is in, outermost first. Scopes nested
+	//deeper than Capacity still count towards depth but aren't named.
+	struct ScopeStack
+	{
+		static const int Capacity = 32;
+
+		LPCTSTR names[Capacity];
+		int depth;
+	};
+
+	//The logging state that follows a task rather than a thread: the ScopeLog
+	//scopes (which also set the indentation) and a request id. Each thread has
+	//its own, used unless another is attached with SwitchLogContext(). Servers
+	//running coroutines or fibers on a thread pool give every task a LogContext
+	//and attach it whenever the task resumes, e.g. from await_resume():
+	//	LogContext *previous = SwitchLogContext(&task.context);
+	//and put the previous one back when it suspends. Zero-initialized is empty.
+	struct LogContext
+	{
+		static const int RequestIdCapacity = 40;
+
+		ScopeStack scopes;
+		char requestId[RequestIdCapacity];
+
+		//Shown in records when Logger::SetRecordFields() includes LogRequestId
+		void SetRequestId(const char *id);
+	};
+	extern __thread LogContext ThreadLogContext;
+	extern __thread LogContext *ActiveLogContext;
+
+	inline LogContext &CurrentLogContext()
+	{
+		LogContext *context = ActiveLogContext;
+		return context != nullptr ? *context : ThreadLogContext;
+	}
+
+	//Attaches context (nullptr for the thread's own) to the calling thread and
+	//returns the one it replaces
+	inline LogContext *SwitchLogContext(LogContext *context)
+	{
+		LogContext *previous = ActiveLogContext;
+		ActiveLogContext = context;
+		return previous;
+	}
+
+	//Attaches a context for the lifetime of the object, for code that doesn't
+	//suspend in between (a fiber's run loop, or a task run to completion)
+	class AttachLogContext
+	{
+		LogContext *_previous;
+
+	public:
+		AttachLogContext(LogContext &context) : _previous(SwitchLogContext(&context)) {}
+		~AttachLogContext() { SwitchLogContext(_previous); }
+		AttachLogContext(const AttachLogContext &) = delete;
+		AttachLogContext &operator=(const AttachLogContext &) = delete;
+	};
+
+	inline LPCTSTR logPrefixes[] = { _T("DEBG: "), _T("INFO: "), _T("WARN: "), _T("ERRR: "), _T("") };
 
 	enum LogLevel
 	{
@@ -67,96 +180,752 @@ namespace neosmart
 		None
 	};
 
+	//The message (format string) passed to the logging functions. Besides
+	//C strings it accepts string views and strings, including slices that
+	//aren't NUL-terminated, without copying them.
+	struct LogMessage
+	{
+		const TCHAR *data;
+		size_t length;
+
+		LogMessage(LPCTSTR message) : data(message), length(_tcsclen(message)) {}
+		LogMessage(std::basic_string_view<TCHAR> message) : data(message.data()), length(message.size()) {}
+		LogMessage(const std::basic_string<TCHAR> &message) : data(message.data()), length(message.size()) {}
+	};
+
+	//Describes one logging statement. The NST_LOG macros below create these as
+	//constant-initialized statics, and each is given a 32-bit id the first time it
+	//logs, so destinations can store the id instead of the metadata.
+	struct LogSite
+	{
+		const char *file;
+		int line;
+		const char *function;
+		LogLevel level;
+		LPCTSTR format;
+		std::atomic<uint32_t> id;
+
+		static uint32_t Register(LogSite &site);
+		static const LogSite *Find(uint32_t id);
+
+		//The site's id, registering it first if need be
+		uint32_t Id()
+		{
+			uint32_t current = id.load(std::memory_order_relaxed);
+			return current != 0 ? current : Register(*this);
+		}
+	};
+
+	/* Record counters
+	 * Every record is counted by level, by call site for the NST_LOG macros and
+	 * by module and level for records logged through a LogModule, as it reaches
+	 * the logger and whether or not any destination takes it. Each thread counts
+	 * into its own cache-line aligned block with plain loads and stores;
+	 * LogMetrics (LogMetrics.h) adds the blocks up when asked. Sites with ids
+	 * past Chunks * ChunkSize, and modules past ModuleChunks * ChunkSize counters,
+	 * are only counted by level.
+	*/
+	struct alignas(64) LogCounters
+	{
+		static const size_t ChunkSize = 64;
+		static const size_t Chunks = 256;
+		static const size_t ModuleChunks = 16;
+
+		struct alignas(64) Chunk
+		{
+			std::atomic<uint64_t> counts[ChunkSize];
+		};
+
+		std::atomic<uint64_t> levels[Passthru + 1];
+		std::atomic<Chunk *> sites[Chunks];
+		//Indexed by (module id - 1) * (Passthru + 1) + level
+		std::atomic<Chunk *> modules[ModuleChunks];
+		//Counted into by several threads at once (the block for exiting threads)
+		bool shared;
+
+		constexpr LogCounters(bool shared = false)
+			: levels{}, sites{}, modules{}, shared(shared)
+		{
+		}
+
+		Chunk *AddChunk(std::atomic<Chunk *> *table, size_t chunk);
+		//Totals across all threads, past and present; sites is indexed by id - 1,
+		//modules as the per-thread table is
+		static void Collect(uint64_t (&levels)[Passthru + 1], std::vector<uint64_t> &sites, std::vector<uint64_t> &modules);
+
+		//Only the owning thread counts into an unshared block, so its increment needn't
+		//be atomic
+		void Increment(std::atomic<uint64_t> &counter) const
+		{
+			if (shared)
+				counter.fetch_add(1, std::memory_order_relaxed);
+			else
+				counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+	};
+	extern __thread LogCounters *ThreadCounters;
+	LogCounters *AttachCounters();
+
+	inline void CountRecord(LogLevel level, uint32_t site)
+	{
+		LogCounters *counters = ThreadCounters;
+		if (counters == nullptr)
+			counters = AttachCounters();
+		counters->Increment(counters->levels[level]);
+
+		size_t index = (size_t) site - 1;
+		if (site != 0 && index < LogCounters::Chunks * LogCounters::ChunkSize)
+		{
+			LogCounters::Chunk *chunk = counters->sites[index / LogCounters::ChunkSize].load(std::memory_order_relaxed);
+			if (chunk == nullptr)
+				chunk = counters->AddChunk(counters->sites, index / LogCounters::ChunkSize);
+			counters->Increment(chunk->counts[index % LogCounters::ChunkSize]);
+		}
+	}
+
+	//Counts a record logged through a module; the level total is counted separately
+	inline void CountModuleRecord(LogLevel level, uint32_t module)
+	{
+		LogCounters *counters = ThreadCounters;
+		if (counters == nullptr)
+			counters = AttachCounters();
+
+		size_t index = ((size_t) module - 1) * (Passthru + 1) + level;
+		if (module != 0 && index < LogCounters::ModuleChunks * LogCounters::ChunkSize)
+		{
+			LogCounters::Chunk *chunk = counters->modules[index / LogCounters::ChunkSize].load(std::memory_order_relaxed);
+			if (chunk == nullptr)
+				chunk = counters->AddChunk(counters->modules, index / LogCounters::ChunkSize);
+			counters->Increment(chunk->counts[index % LogCounters::ChunkSize]);
+		}
+	}
+
+	//A format argument captured by value, for destinations that store a record's
+	//arguments rather than its text. Types without a faithful encoding are Other.
+	struct LogArgument
+	{
+		enum Type : unsigned char
+		{
+			Signed,
+			Unsigned,
+			Float,
+			String,
+			Other
+		};
+
+		Type type;
+		unsigned char size;
+		union
+		{
+			long long i;
+			unsigned long long u;
+			double d;
+			struct
+			{
+				const char *data;
+				size_t length;
+			} s;
+		};
+	};
+
+	//The conversion an argument is formatted with and its precision, -1 if it has
+	//none or Variable if it comes from another argument. Arguments consumed by a '*'
+	//have type '*', and arguments without any conversion type '\0'.
+	struct LogConversion
+	{
+		static const int Variable = -2;
+
+		TCHAR type;
+		int precision;
+	};
+	void FindConversions(LPCTSTR format, LogConversion *conversions, size_t count);
+
+	//An argument computed only if the record is formatted, made with lazy():
+	//	logger.Debug("state: %s", lazy([&] { return object.ToString(); }));
+	//The function runs at most once per record, on the logging thread, and its
+	//result is formatted as if it had been passed directly. Nothing runs when no
+	//destination wants the level. Queueing destinations only ever see the result.
+	template<typename Function>
+	struct LazyArgument
+	{
+		Function function;
+	};
+
+	template<typename Function>
+	inline LazyArgument<typename std::decay<Function>::type> lazy(Function &&function)
+	{
+		return { std::forward<Function>(function) };
+	}
+
+	//Found by tinyformat through argument-dependent lookup
+	template<typename Function>
+	inline void formatValue(std::ostream &out, const char *fmtBegin, const char *fmtEnd, int ntrunc, const LazyArgument<Function> &value)
+	{
+		using tinyformat::formatValue;
+		formatValue(out, fmtBegin, fmtEnd, ntrunc, value.function());
+	}
+
+	template<typename T>
+	inline LogArgument CaptureArgument(const T &value, const LogConversion &conversion)
+	{
+		LogArgument argument;
+		argument.size = (unsigned char) sizeof(T);
+		//Character types print differently under %c and %d, so they aren't captured
+		if constexpr (std::is_same<T, bool>::value || std::is_same<T, wchar_t>::value ||
+			std::is_same<T, char16_t>::value || std::is_same<T, char32_t>::value || sizeof(T) == 1)
+			argument.type = LogArgument::Other;
+		else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value)
+		{
+			argument.type = LogArgument::Signed;
+			argument.i = value;
+		}
+		else if constexpr (std::is_integral<T>::value || std::is_enum<T>::value)
+		{
+			argument.type = std::is_enum<T>::value ? LogArgument::Other : LogArgument::Unsigned;
+			argument.u = (unsigned long long) value;
+		}
+		else if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value)
+		{
+			argument.type = LogArgument::Float;
+			argument.d = value;
+		}
+		else if constexpr (std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value)
+		{
+			argument.type = LogArgument::String;
+			argument.s.data = value.data();
+			argument.s.length = value.size();
+		}
+		else if constexpr (std::is_convertible<T, const char *>::value)
+		{
+			//Only %s reads the characters, and only as far as its precision; under %p or
+			//%x the pointer may not point at a string at all
+			const char *string = value;
+			argument.type = LogArgument::Other;
+			if (string != nullptr && conversion.type == 's' && conversion.precision != LogConversion::Variable)
+			{
+				argument.type = LogArgument::String;
+				argument.s.data = string;
+				argument.s.length = conversion.precision < 0 ? strlen(string) : strnlen(string, (size_t) conversion.precision);
+			}
+		}
+		else
+			argument.type = LogArgument::Other;
+		return argument;
+	}
+
+	template<typename... Args>
+	inline void CaptureArguments(LPCTSTR format, LogArgument *arguments, const Args&... args)
+	{
+		LogConversion conversions[sizeof...(Args) + 1];
+		FindConversions(format, conversions, sizeof...(Args));
+		size_t i = 0;
+		((arguments[i] = CaptureArgument(args, conversions[i]), ++i), ...);
+		(void) i;
+	}
+
+	//A fully formatted record as handed to each destination. Records from NST_LOG
+	//statements also carry their site and captured arguments, and warnings and
+	//errors carry the names of the scopes they were logged from. cpu is only
+	//looked up when the LogCpu field is enabled and is -1 otherwise. timestamp
+	//(nanoseconds since the epoch) is 0 unless a destination that queues records,
+	//such as ShardedSink, stamped it when the record was logged.
+	struct LogRecord
+	{
+		LogLevel level;
+		LPCTSTR message;
+		size_t length;
+		const LogSite *site;
+		const LogArgument *arguments;
+		size_t argumentCount;
+		const LPCTSTR *scopes;
+		size_t scopeCount;
+		uint32_t thread;
+		int cpu;
+		uint64_t timestamp;
+		//Counts the logging thread's records, so their order can be recovered where a
+		//destination doesn't keep it (ShardedSink writes urgent records first)
+		uint64_t sequence;
+	};
+
+	//Destinations other than plain streams derive from LogSink. Write() may be
+	//called from several threads at once and must do its own synchronization.
+	class LogSink
+	{
+	public:
+		virtual ~LogSink() {}
+		virtual void Write(const LogRecord &record) = 0;
+		//Records of one LogBatch, all at the same level; their text is contiguous
+		virtual void WriteBatch(const LogRecord *records, size_t count)
+		{
+			for (size_t i = 0; i < count; ++i)
+				Write(records[i]);
+		}
+		virtual void Flush() {}
+		//Whether Write() reads LogRecord::arguments; NST_LOG statements only capture
+		//their arguments while a destination does
+		virtual bool UsesArguments() const { return false; }
+		//Called around fork(), see "Lifecycle" below. PrepareFork() must leave nothing
+		//buffered and keep writers out until AfterFork(), which in the child also has
+		//to restart any threads the destination runs.
+		virtual void PrepareFork() { Flush(); }
+		virtual void AfterFork(bool /*child*/) {}
+	};
+
+	//Adapts an ostream to the LogSink interface; used for every ostream destination
+	class StreamSink : public LogSink
+	{
+		ostream &_output;
+
+	public:
+		constexpr StreamSink(ostream &output) : _output(output) {}
+		virtual void Write(const LogRecord &record);
+		virtual void WriteBatch(const LogRecord *records, size_t count);
+		virtual void Flush();
+	};
+
+	//A growable character buffer that a std::ostream can format into
+	class LogBuffer : public std::streambuf
+	{
+		char *_data;
+		size_t _capacity;
+
+		bool Grow(size_t capacity);
+
+	protected:
+		virtual int_type overflow(int_type c);
+		virtual std::streamsize xsputn(const char *s, std::streamsize count);
+
+	public:
+		LogBuffer();
+		~LogBuffer();
+
+		//Returns room for at least size bytes, discarding the contents
+		char *Reserve(size_t size);
+		const char *Data() const { return pbase(); }
+		size_t Length() const { return (size_t)(pptr() - pbase()); }
+		size_t Capacity() const { return _capacity; }
+		void Clear() { setp(_data, _data + _capacity); }
+		//Gives the memory back if the buffer has grown past limit
+		void Trim(size_t limit);
+	};
+
+	/* Formatting memory
+	 * Each thread formats its records in its own LogArena: one buffer for the
+	 * format string with its prefix and indentation, one for the formatted
+	 * record, and the ostream tinyformat writes through. All of them are kept
+	 * from one record to the next, so once a thread's buffers have grown to fit
+	 * its records, logging no longer allocates. A buffer that grows past
+	 * RetainedSize for an unusually long record is freed again afterwards,
+	 * bounding what each thread keeps to 2 * RetainedSize, and Footprint()
+	 * reports the total currently held by all threads.
+	 *
+	 * An arena is lent to one record at a time. Logging from inside another
+	 * log call on the same thread (from an argument's operator<< or a sink)
+	 * gets a temporary arena instead.
+	*/
+	class LogArena
+	{
+		bool _busy;
+
+	public:
+		static const size_t RetainedSize = 16 * 1024;
+
+		LogBuffer mask;
+		LogBuffer record;
+		tfm::FormatContext formatter;
+
+		LogArena();
+
+		static size_t Footprint();
+
+		class Lease
+		{
+			LogArena *_arena;
+			std::unique_ptr<LogArena> _temporary;
+
+		public:
+			Lease();
+			~Lease();
+
+			LogArena *operator->() const { return _arena; }
+			LogArena &operator*() const { return *_arena; }
+		};
+	};
+
+	class LogModule;
+	class LogBatch;
+
+	/* Runtime configuration
+	 * Logger::LoadConfiguration() reads a plain-text file of "key = value" lines
+	 * and applies it in one step; Logger::WatchConfiguration() does the same and
+	 * then reloads the file whenever it is rewritten (inotify on Linux, mtime
+	 * polling elsewhere). Recognized keys:
+	 *   level = Debug            equivalent to SetLogLevel(Debug)
+	 *   module.<name> = Warn     threshold for LogModule instances named <name>
+	 *   output = stderr [Level]  replaces the destinations with stderr, stdout
+	 *   output = <path> [Level]  or an appended file; may be repeated
+	 * Blank lines and lines starting with # are ignored. Without any output
+	 * lines the current destinations are kept. Output lines only replace
+	 * ostream destinations; LogSink destinations added in code are retained.
+	 *
+	 * Destinations are kept in an immutable table that is swapped atomically,
+	 * so producers are never blocked by a reconfiguration and records already
+	 * being broadcast finish on the destinations they started with.
+	*/
+
+	/* Lifecycle
+	 * Once a logger's destinations have been configured, it flushes them when
+	 * the process ends through exit() or quick_exit(), and keeps them consistent
+	 * across fork(): before forking, every destination is flushed and writers
+	 * are held off, so nothing buffered is written by both processes; afterwards
+	 * the child restarts the destinations' background threads. Destinations that
+	 * write a file at offsets they track themselves (FileSink, BinaryLogSink)
+	 * stop writing in the child rather than overwrite the parent's records; give
+	 * the child destinations of its own. Configuration watching stops in the
+	 * child too. A destination that's destroyed before the process ends must
+	 * be removed from its loggers first.
+	 *
+	 * Shutdown() stops a logger in bounded time: it removes every destination,
+	 * so later records are dropped, and waits at most timeout for them to flush.
+	*/
+
 	class Logger
 	{
 	private:
-		LogLevel _logLevel;
-		std::map<ostream*, LogLevel> _outputs;
+		struct Destination
+		{
+			LogSink *sink;
+			LogLevel level;
+		};
+
+		struct Destinations
+		{
+			//Sorted by level, most verbose first, so that Broadcast() can stop at the
+			//first destination that doesn't want a record
+			std::vector<Destination> outputs;
+			std::map<ostream*, std::shared_ptr<LogSink>> streams;
+			std::vector<std::shared_ptr<ostream>> owned;
+
+			void SetLevel(LogSink *sink, LogLevel level);
+			void Remove(LogSink *sink);
+			void SetStreamLevel(ostream *stream, LogLevel level);
+		};
+
+		//State only the configuration calls use, created by the first of them
+		struct Settings
+		{
+			std::vector<LogModule*> modules;
+			std::map<std::string, LogLevel> moduleLevels;
+			std::thread watcher;
+		};
+
+		std::atomic<LogLevel> _logLevel;
+		std::atomic<LogLevel> _threshold;
+		//Null until the destinations are first changed, which stands for _defaultSink
+		//at _logLevel. Everything else is constant-initialized as well, so a Logger
+		//can be set up before any code runs; see ImmortalLogger.
+		//Replaced whole under _configLock. Readers never lock: they count themselves in
+		//_readers while copying the shared_ptr, and Install() frees the old one only once
+		//no reader can still be copying it. (The shared_ptr atomics would lock, inside
+		//the library, where fork() can leave one of their locks held in the child.)
+		std::atomic<std::shared_ptr<const Destinations>*> _outputs;
+		mutable std::atomic<unsigned> _readers[2];
+		std::atomic<unsigned> _epoch;
 		ostream *_defaultLog;
+		StreamSink _defaultSink;
+
+		std::mutex _configLock;
+		std::unique_ptr<Settings> _settings;
+		std::atomic<bool> _watching;
+		std::atomic<bool> _scopeEvents;
+		std::atomic<bool> _breadcrumbs;
+		std::atomic<unsigned> _fields;
+		//Whether any destination reads LogRecord::arguments
+		std::atomic<bool> _arguments;
+		bool _tracked;
 
 		template<typename... Args>
-		inline void InnerLog(LogLevel level, LPCTSTR message, const Args&... args)
+		inline void InnerLog(const LogSite *site, LogLevel level, const LogMessage &message, const Args&... args)
 		{
-			TCHAR *mask;
-
 			//As an optimization, we're not going to check level so don't pass in None!
 			assert(level >= LogLevel::Debug && level <= LogLevel::Passthru);
+			CountRecord(level, site != nullptr ? site->id.load(std::memory_order_relaxed) : 0);
+
+			//Nothing is listening at this level, so skip the formatting altogether
+			if (level < _threshold.load(std::memory_order_relaxed))
+				return;
+
+			LogArena::Lease arena;
+			const LogContext &context = CurrentLogContext();
+			unsigned fields = _fields.load(std::memory_order_relaxed);
+			int cpu = (fields & LogCpu) ? CurrentCpu() : -1;
+			uint64_t sequence = NextSequence();
+			TCHAR *mask = BuildMask(*arena, context, level, message, fields, cpu, sequence);
+
+			arena->record.Clear();
+			arena->formatter.format(mask, args...);
 
-			//Indentation only works if ScopeLog is printing 
-			size_t size = 4 + 2 + _tcsclen(message) + 2 + 1;
-			if (IndentLevel >= 0 && _logLevel <= neosmart::Debug)
+			LogRecord record = { level, arena->record.Data(), arena->record.Length(), nullptr, nullptr, 0, nullptr, 0, CurrentThreadId(), cpu, 0, sequence };
+			if (level == neosmart::Warn || level == neosmart::Error)
 			{
-				size += (size_t)IndentLevel;
-				mask = new TCHAR[size];
-				_stprintf_s(mask, size, _T("%*s%s\r\n"), IndentLevel + 4, logPrefixes[level], message);
+				record.scopes = context.scopes.names;
+				record.scopeCount = (size_t) std::min(context.scopes.depth, (int) ScopeStack::Capacity);
 			}
-			else
+			//Capturing costs a walk of the format string, so it's only done for destinations
+			//that read the arguments
+			if (site != nullptr && _arguments.load(std::memory_order_relaxed))
 			{
-				mask = new TCHAR[size];
-				_stprintf_s(mask, size, _T("%s%s\r\n"), logPrefixes[level], message);
+				LogArgument arguments[sizeof...(Args) + 1];
+				CaptureArguments(site->format, arguments, args...);
+				record.site = site;
+				record.arguments = arguments;
+				record.argumentCount = sizeof...(Args);
+				Broadcast(record);
 			}
-
-			std::string final = tfm::format(mask, args...);
-
-			Broadcast(level, final.c_str());
-			delete[] mask;
+			else
+				Broadcast(record);
 		}
 
-		void Broadcast(LogLevel level, LPCTSTR message);
+		size_t Indentation(const LogContext &context, size_t prefix) const;
+		static TCHAR *WriteFields(TCHAR *out, const LogContext &context, unsigned fields, int cpu, uint64_t sequence, bool escape);
+		TCHAR *BuildMask(LogArena &arena, const LogContext &context, LogLevel level, const LogMessage &message, unsigned fields, int cpu, uint64_t sequence);
+		void EmitScopeEvent(bool entering, LPCTSTR name);
+		void Broadcast(const LogRecord &record);
+		void Broadcast(const LogRecord *records, size_t count);
+		std::shared_ptr<const Destinations> Current() const;
+		const Destinations &Configured();
+		Settings &ConfiguredSettings();
+		void Install(std::shared_ptr<const Destinations> outputs);
+		void Publish(std::shared_ptr<const Destinations> outputs);
+		static void PrepareFork();
+		static void AfterFork(bool child);
+		static void AfterForkInParent() { AfterFork(false); }
+		static void AfterForkInChild() { AfterFork(true); }
+		static void FlushAtExit();
+		void WatchLoop(std::string path, int notifier);
+
+		friend class LogModule;
+		friend class LogBatch;
+		void Register(LogModule *module);
+		void Unregister(LogModule *module);
 
 	public:
 		static Logger &GlobalLogger();
-		Logger(LogLevel logLevel = neosmart::Warn);
+#if defined(_WIN32) && defined(UNICODE)
+		constexpr Logger(LogLevel logLevel = neosmart::Warn)
+			: _logLevel(logLevel), _threshold(logLevel), _outputs(nullptr), _readers{}, _epoch(0), _defaultLog(&std::wcerr), _defaultSink(std::wcerr),
+#else
+		constexpr Logger(LogLevel logLevel = neosmart::Warn)
+			: _logLevel(logLevel), _threshold(logLevel), _outputs(nullptr), _readers{}, _epoch(0), _defaultLog(&std::cerr), _defaultSink(std::cerr),
+#endif
+			_configLock(), _settings(), _watching(false), _scopeEvents(true), _breadcrumbs(false), _fields(0), _arguments(false), _tracked(false)
+		{
+		}
+		~Logger();
 
 		void SetLogLevel(LogLevel level);
 		void AddLogDestination(ostream &output);
 		void AddLogDestination(ostream &output, LogLevel level);
+		void AddLogDestination(LogSink &output);
+		void AddLogDestination(LogSink &output, LogLevel level);
+		void RemoveLogDestination(LogSink &output);
 		void ClearLogDestinations();
+		void Flush();
+		//Drops all later records and flushes the destinations; false if they didn't
+		//finish within timeout, in which case the flush carries on in the background
+		//and the destinations must stay alive until it's done
+		bool Shutdown(std::chrono::milliseconds timeout);
+
+		bool LoadConfiguration(const char *path);
+		bool WatchConfiguration(const char *path);
+		void StopWatching();
+
+		//ScopeLog always tracks the scope stack; these control whether it also logs
+		//entering and leaving each scope at Debug (on by default), and whether
+		//warnings and errors get the stack appended as " [in outer > inner]"
+		void SetScopeEvents(bool enabled);
+		void SetBreadcrumbs(bool enabled);
+
+		//Adds the given LogField values to every record as "[1234 name cpu5 req=id seq=42] "
+		//after the level prefix. None are shown by default.
+		void SetRecordFields(unsigned fields);
+
+		//Used by ScopeLog
+		inline void ScopeEvent(bool entering, LPCTSTR name)
+		{
+			if (_scopeEvents.load(std::memory_order_relaxed) && IsEnabled(neosmart::Debug))
+				EmitScopeEvent(entering, name);
+		}
 
 		template<typename... Args>
-		inline void Log(LogLevel level, LPCTSTR message, const Args&... args)
+		inline void Log(LogLevel level, const LogMessage &message, const Args&... args)
 		{
-			InnerLog(level, message, args...);
+			InnerLog(nullptr, level, message, args...);
+		}
+
+		//Used by the NST_LOG macros
+		template<typename... Args>
+		inline void Log(LogSite &site, const Args&... args)
+		{
+			site.Id();
+			InnerLog(&site, site.level, site.format, args...);
+		}
+
+		inline bool IsEnabled(LogLevel level) const
+		{
+			return level >= _threshold.load(std::memory_order_relaxed);
 		}
 
 		//Convenience Functions
 		template<typename... Args>
-		inline void Log(LPCTSTR message, const Args&... args)
+		inline void Log(const LogMessage &message, const Args&... args)
 		{
-			InnerLog(neosmart::Info, message, args...);
+			InnerLog(nullptr, neosmart::Info, message, args...);
 		}
 
 		template<typename... Args>
-		inline void Debug(LPCTSTR message, const Args&... args)
+		inline void Debug(const LogMessage &message, const Args&... args)
 		{
-			InnerLog(neosmart::Debug, message, args...);
+			InnerLog(nullptr, neosmart::Debug, message, args...);
 		}
 
 		template<typename... Args>
-		inline void Info(LPCTSTR message, const Args&... args)
+		inline void Info(const LogMessage &message, const Args&... args)
 		{
-			InnerLog(neosmart::Info, message, args...);
+			InnerLog(nullptr, neosmart::Info, message, args...);
 		}
 
 		template<typename... Args>
-		inline void Warn(LPCTSTR message, const Args&... args)
+		inline void Warn(const LogMessage &message, const Args&... args)
 		{
-			InnerLog(neosmart::Warn, message, args...);
+			InnerLog(nullptr, neosmart::Warn, message, args...);
 		}
 
 		template<typename... Args>
-		inline void Error(LPCTSTR message, const Args&... args)
+		inline void Error(const LogMessage &message, const Args&... args)
 		{
-			InnerLog(neosmart::Error, message, args...);
+			InnerLog(nullptr, neosmart::Error, message, args...);
 		}
 
 		template<typename... Args>
-		inline void Passthru(LPCTSTR message, const Args&... args)
+		inline void Passthru(const LogMessage &message, const Args&... args)
 		{
-			InnerLog(neosmart::Passthru, message, args...);
+			InnerLog(nullptr, neosmart::Passthru, message, args...);
 		}
 	};
 
+	//A named subsystem with its own threshold on top of the logger's destinations.
+	//Thresholds are set in code or through "module.<name>" configuration keys.
+	class LogModule
+	{
+		friend class Logger;
+
+		Logger &_logger;
+		std::string _name;
+		std::atomic<LogLevel> _logLevel;
+		//Modules with the same name share their counters
+		uint32_t _counter;
+
+	public:
+		LogModule(const char *name, Logger &logger = Logger::GlobalLogger());
+		~LogModule();
+
+		void SetLogLevel(LogLevel level);
+
+		//The name counted under a module counter id, or empty for an unknown id
+		static std::string CounterName(uint32_t counter);
+
+		template<typename... Args>
+		inline void Log(LogLevel level, const LogMessage &message, const Args&... args)
+		{
+			CountModuleRecord(level, _counter);
+			if (level >= _logLevel.load(std::memory_order_relaxed))
+				_logger.Log(level, message, args...);
+			else
+				CountRecord(level, 0);
+		}
+
+		template<typename... Args>
+		inline void Debug(const LogMessage &message, const Args&... args)
+		{
+			Log(neosmart::Debug, message, args...);
+		}
+
+		template<typename... Args>
+		inline void Info(const LogMessage &message, const Args&... args)
+		{
+			Log(neosmart::Info, message, args...);
+		}
+
+		template<typename... Args>
+		inline void Warn(const LogMessage &message, const Args&... args)
+		{
+			Log(neosmart::Warn, message, args...);
+		}
+
+		template<typename... Args>
+		inline void Error(const LogMessage &message, const Args&... args)
+		{
+			Log(neosmart::Error, message, args...);
+		}
+	};
+
+	/* Batched records
+	 * A LogBatch logs many records with the same level and format string, as a
+	 * loop over work items would, for less than the same number of Log() calls:
+	 *	LogBatch batch(logger, Info, "item %d: %s");
+	 *	for (const Item &item : items)
+	 *		batch.Add(item.id, item.result);
+	 * The prefix, fields and indentation are worked out once, when the batch is
+	 * created. Each Add() formats into one contiguous buffer, and Commit() hands
+	 * all the records to each destination in a single WriteBatch() call. Commit()
+	 * runs automatically once CommitSize bytes are pending, and from the
+	 * destructor. Add() does nothing, not even formatting, if no destination
+	 * wants the level. The records all come from the creating thread; don't
+	 * share a batch between threads.
+	*/
+	class LogBatch
+	{
+		Logger &_logger;
+		LogLevel _level;
+		bool _enabled;
+		unsigned _fields;
+		int _cpu;
+		LogArena _arena;
+		const TCHAR *_mask;
+		//Kept only with LogSequence, which needs a mask per record
+		std::basic_string<TCHAR> _format;
+		std::vector<size_t> _ends;
+		std::vector<uint64_t> _sequences;
+
+	public:
+		static const size_t CommitSize = 64 * 1024;
+
+		LogBatch(Logger &logger, LogLevel level, const LogMessage &message);
+		~LogBatch();
+		LogBatch(const LogBatch &) = delete;
+		LogBatch &operator=(const LogBatch &) = delete;
+
+		template<typename... Args>
+		void Add(const Args&... args)
+		{
+			CountRecord(_level, 0);
+			if (!_enabled)
+				return;
+			uint64_t sequence = NextSequence();
+			if (_fields & LogSequence)
+				_mask = _logger.BuildMask(_arena, CurrentLogContext(), _level, _format, _fields, _cpu, sequence);
+			_arena.formatter.format(_mask, args...);
+			_ends.push_back(_arena.record.Length());
+			_sequences.push_back(sequence);
+			if (_arena.record.Length() >= CommitSize)
+				Commit();
+		}
+
+		//Hands the pending records to the destinations
+		void Commit();
+	};
+
 	class ScopeLog
 	{
 		LPCTSTR _name;
@@ -174,10 +943,44 @@ namespace neosmart
 		~ScopeLog();
 	};
 
-	inline Logger &logger = Logger::GlobalLogger();
+	//The global logger, writing to stderr at Debug until configured otherwise. It is
+	//constant-initialized, so it works from static initializers in any translation
+	//unit and logging through it checks no guard variable, and it's never destroyed,
+	//so static destructors can still log through it.
+	union ImmortalLogger
+	{
+		Logger logger;
+
+		constexpr ImmortalLogger(LogLevel level) : logger(level) {}
+		~ImmortalLogger() {}
+	};
+	extern ImmortalLogger globalLogger;
+	inline Logger &logger = globalLogger.logger;
 }
 
 
+/* Call-site logging
+ * NST_LOG(Warn, "disk %s is %d%% full", name, percent) logs through the global
+ * logger like logger.Warn(), but also records the statement's file, line,
+ * function, level and format once in a static LogSite. Destinations such as
+ * BinaryLogSink then store only the site id and the arguments. The arguments
+ * aren't evaluated at all when nothing is listening at that level.
+*/
+#define NST_LOG_TO(logger, level, format, ...) \
+	do \
+	{ \
+		static neosmart::LogSite _nstLogSite = { __FILE__, __LINE__, __func__, level, format, 0 }; \
+		if ((logger).IsEnabled(level)) \
+			(logger).Log(_nstLogSite, ##__VA_ARGS__); \
+		else \
+			neosmart::CountRecord(level, _nstLogSite.Id()); \
+	} while (0)
+#define NST_LOG(level, format, ...) NST_LOG_TO(neosmart::logger, neosmart::level, format, ##__VA_ARGS__)
+#define NST_DEBUG(format, ...) NST_LOG(Debug, format, ##__VA_ARGS__)
+#define NST_INFO(format, ...) NST_LOG(Info, format, ##__VA_ARGS__)
+#define NST_WARN(format, ...) NST_LOG(Warn, format, ##__VA_ARGS__)
+#define NST_ERROR(format, ...) NST_LOG(Error, format, ##__VA_ARGS__)
+
 #ifdef UNDEF_TINYFORMAT_USE_VARIADIC_TEMPLATES
 #undef TINYFORMAT_USE_VARIADIC_TEMPLATES
 #endif
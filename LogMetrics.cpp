@@ -0,0 +1,193 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "LogMetrics.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+using namespace std;
+
+namespace neosmart
+{
+	static const char *levelNames[] = { "debug", "info", "warn", "error", "passthru" };
+
+	//Label values escape backslashes, quotes and newlines
+	static void AppendLabel(string &out, const char *name, const char *value)
+	{
+		out += name;
+		out += "=\"";
+		for (const char *c = value != nullptr ? value : ""; *c != '\0'; ++c)
+		{
+			if (*c == '\\' || *c == '"')
+				out += '\\';
+			if (*c == '\n')
+				out += "\\n";
+			else
+				out += *c;
+		}
+		out += '"';
+	}
+
+	string LogMetrics::Prometheus()
+	{
+		uint64_t levels[Passthru + 1];
+		vector<uint64_t> sites, modules;
+		LogCounters::Collect(levels, sites, modules);
+
+		string out;
+		out += "# HELP neosmart_log_records_total Records logged, including those no destination took.\n";
+		out += "# TYPE neosmart_log_records_total counter\n";
+		for (int i = Debug; i <= Passthru; ++i)
+			out += string("neosmart_log_records_total{level=\"") + levelNames[i] + "\"} " + to_string(levels[i]) + "\n";
+
+		out += "# HELP neosmart_log_site_records_total Records logged by each NST_LOG statement.\n";
+		out += "# TYPE neosmart_log_site_records_total counter\n";
+		for (size_t i = 0; i < sites.size(); ++i)
+		{
+			const LogSite *site = sites[i] != 0 ? LogSite::Find((uint32_t)(i + 1)) : nullptr;
+			if (site == nullptr)
+				continue;
+			out += "neosmart_log_site_records_total{";
+			AppendLabel(out, "level", levelNames[site->level]);
+			out += ',';
+			AppendLabel(out, "file", site->file);
+			out += ",line=\"" + to_string(site->line) + "\",";
+			AppendLabel(out, "function", site->function);
+			out += "} " + to_string(sites[i]) + "\n";
+		}
+
+		out += "# HELP neosmart_log_module_records_total Records logged through each LogModule, including those it filtered.\n";
+		out += "# TYPE neosmart_log_module_records_total counter\n";
+		const size_t perModule = Passthru + 1;
+		for (size_t i = 0; i + perModule <= modules.size(); i += perModule)
+		{
+			if (all_of(modules.begin() + i, modules.begin() + i + perModule, [](uint64_t count) { return count == 0; }))
+				continue;
+			string name = LogModule::CounterName((uint32_t)(i / perModule + 1));
+			for (int level = Debug; level <= Passthru; ++level)
+			{
+				out += "neosmart_log_module_records_total{";
+				AppendLabel(out, "module", name.c_str());
+				out += string(",level=\"") + levelNames[level] + "\"} " + to_string(modules[i + level]) + "\n";
+			}
+		}
+		return out;
+	}
+
+	bool LogMetrics::WriteFile(const char *path)
+	{
+		string temporary = string(path) + ".tmp";
+		FILE *file = fopen(temporary.c_str(), "wb");
+		if (file == nullptr)
+			return false;
+		string text = Prometheus();
+		bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+		written = fclose(file) == 0 && written;
+		if (!written || rename(temporary.c_str(), path) != 0)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return true;
+	}
+
+#ifndef _WIN32
+	MetricsServer::MetricsServer(const char *path)
+		: _path(path), _socket(-1)
+	{
+		_wake[0] = _wake[1] = -1;
+		sockaddr_un local = {};
+		if (strlen(path) >= sizeof(local.sun_path) || pipe2(_wake, O_CLOEXEC) != 0)
+			return;
+		local.sun_family = AF_UNIX;
+		strcpy(local.sun_path, path);
+
+		//A socket left behind by an earlier run would make bind() fail
+		unlink(path);
+		_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (_socket >= 0 && (bind(_socket, (sockaddr *) &local, sizeof(local)) != 0 || listen(_socket, 16) != 0))
+		{
+			close(_socket);
+			_socket = -1;
+		}
+		if (_socket >= 0)
+			_server = thread(&MetricsServer::ServeLoop, this);
+	}
+
+	MetricsServer::~MetricsServer()
+	{
+		if (_server.joinable())
+		{
+			char stop = 0;
+			while (write(_wake[1], &stop, 1) < 0 && errno == EINTR)
+				;
+			_server.join();
+		}
+		if (_socket >= 0)
+		{
+			close(_socket);
+			unlink(_path.c_str());
+		}
+		if (_wake[0] >= 0)
+		{
+			close(_wake[0]);
+			close(_wake[1]);
+		}
+	}
+
+	void MetricsServer::ServeLoop()
+	{
+		while (true)
+		{
+			pollfd waiting[2] = { { _socket, POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+			if (poll(waiting, 2, -1) < 0 && errno != EINTR)
+				return;
+			if (waiting[1].revents != 0)
+				return;
+			if (waiting[0].revents == 0)
+				continue;
+
+			int client = accept4(_socket, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0)
+				continue;
+
+			//Read the request, if the client sends one, so closing doesn't reset the connection
+			string request;
+			char buffer[1024];
+			pollfd readable = { client, POLLIN, 0 };
+			while (request.size() < 8192 && request.find("\r\n\r\n") == string::npos && poll(&readable, 1, 100) > 0)
+			{
+				ssize_t count = read(client, buffer, sizeof(buffer));
+				if (count <= 0)
+					break;
+				request.append(buffer, (size_t) count);
+			}
+
+			string body = LogMetrics::Prometheus();
+			string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+				to_string(body.size()) + "\r\n\r\n" + body;
+			for (size_t sent = 0; sent < response.size(); )
+			{
+				ssize_t count = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+				if (count < 0 && errno == EINTR)
+					continue;
+				if (count <= 0)
+					break;
+				sent += (size_t) count;
+			}
+			close(client);
+		}
+	}
+#endif
+}
@@ -0,0 +1,55 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+
+/* Record metrics
+ * Publishes the record counters kept by the logger (see LogCounters) in the
+ * Prometheus text format, so alerting on warnings and errors doesn't have to
+ * parse the output:
+ *   neosmart_log_records_total{level="warn"} 12
+ *   neosmart_log_site_records_total{level="warn",file="server.cpp",line="88",function="Accept"} 3
+ *   neosmart_log_module_records_total{module="net",level="warn"} 5
+ * The counts include records that no destination took. Only sites and modules
+ * that have logged at least once are listed; modules sharing a name share their
+ * counts.
+ *
+ * WriteFile() replaces a file with a snapshot atomically, as node_exporter's
+ * textfile collector expects. A MetricsServer answers every connection on a
+ * Unix socket with a fresh snapshot, wrapped in an HTTP/1.0 response so that
+ * `curl --unix-socket` and similar agents can scrape it.
+*/
+
+namespace neosmart
+{
+	class LogMetrics
+	{
+	public:
+		static std::string Prometheus();
+		static bool WriteFile(const char *path);
+	};
+
+#ifndef _WIN32
+	class MetricsServer
+	{
+		std::string _path;
+		int _socket;
+		int _wake[2];
+		std::thread _server;
+
+		void ServeLoop();
+
+	public:
+		MetricsServer(const char *path);
+		~MetricsServer();
+
+		bool IsListening() const { return _socket >= 0; }
+	};
+#endif
+}
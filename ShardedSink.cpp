@@ -0,0 +1,402 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "ShardedSink.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <time.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace neosmart
+{
+	//How a record is kept in a shard's queue. The text follows, padded to 8 bytes, then
+	//extra bytes holding the arguments, the scope names and the arguments' strings.
+	struct QueuedRecord
+	{
+		uint64_t timestamp;
+		uint32_t thread;
+		int32_t cpu;
+		uint32_t length;
+		uint32_t level;
+		uint64_t sequence;
+		const LogSite *site;
+		uint32_t argumentCount;
+		uint32_t scopeCount;
+		uint32_t extra;
+	};
+
+	static size_t QueuedSize(size_t length)
+	{
+		return (sizeof(QueuedRecord) + length + 7) & ~(size_t)7;
+	}
+
+	//Parses a kernel CPU list such as "0-3,8-11"
+	static vector<int> ParseCpuList(const string &list)
+	{
+		vector<int> cpus;
+		stringstream ranges(list);
+		string range;
+		while (getline(ranges, range, ','))
+		{
+			int first, last;
+			char dash;
+			stringstream parser(range);
+			if (!(parser >> first))
+				continue;
+			if (!(parser >> dash >> last) || dash != '-')
+				last = first;
+			for (int cpu = first; cpu <= last; ++cpu)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+
+	vector<vector<int>> ShardedSink::Topology()
+	{
+		vector<vector<int>> nodes;
+#ifdef __linux__
+		DIR *directory = opendir("/sys/devices/system/node");
+		if (directory != nullptr)
+		{
+			vector<int> ids;
+			while (dirent *entry = readdir(directory))
+			{
+				if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+					ids.push_back(atoi(entry->d_name + 4));
+			}
+			closedir(directory);
+			sort(ids.begin(), ids.end());
+
+			for (int id : ids)
+			{
+				ifstream file("/sys/devices/system/node/node" + to_string(id) + "/cpulist");
+				string list;
+				if (getline(file, list))
+				{
+					vector<int> cpus = ParseCpuList(list);
+					if (!cpus.empty())
+						nodes.push_back(cpus);
+				}
+			}
+		}
+#endif
+		if (nodes.empty())
+		{
+			vector<int> cpus;
+			for (unsigned cpu = 0; cpu < max(thread::hardware_concurrency(), 1u); ++cpu)
+				cpus.push_back((int) cpu);
+			nodes.push_back(cpus);
+		}
+		return nodes;
+	}
+
+	ShardedSink::ShardedSink(Factory factory, unsigned coresPerShard, size_t queueSize, int flushInterval, LogLevel urgentLevel)
+		: _queueSize(queueSize), _flushInterval(max(flushInterval, 1)), _urgentLevel(urgentLevel)
+	{
+		//The interval is also how long an idle consumer sleeps, so 0 would have it spin
+		//Split each node into groups of at most coresPerShard CPUs
+		for (const vector<int> &node : Topology())
+		{
+			size_t size = coresPerShard != 0 ? coresPerShard : node.size();
+			for (size_t first = 0; first < node.size(); first += size)
+			{
+				unique_ptr<Shard> shard(new Shard());
+				shard->cpus.assign(node.begin() + first, node.begin() + min(first + size, node.size()));
+				shard->flushRequested = 0;
+				shard->flushed = 0;
+				shard->stopping = false;
+				shard->urgentWaiting = false;
+				for (int cpu : shard->cpus)
+				{
+					if ((size_t) cpu >= _shardOf.size())
+						_shardOf.resize(cpu + 1, UINT_MAX);
+					_shardOf[cpu] = (unsigned) _shards.size();
+				}
+				_shards.push_back(move(shard));
+			}
+		}
+
+		for (unsigned i = 0; i < _shards.size(); ++i)
+			_shards[i]->sink = factory(i);
+		for (unique_ptr<Shard> &shard : _shards)
+			shard->consumer = thread(&ShardedSink::ConsumerLoop, this, ref(*shard));
+	}
+
+	ShardedSink::~ShardedSink()
+	{
+		for (unique_ptr<Shard> &shard : _shards)
+		{
+			lock_guard<mutex> lock(shard->lock);
+			shard->stopping = true;
+			shard->wake.notify_one();
+		}
+		for (unique_ptr<Shard> &shard : _shards)
+			shard->consumer.join();
+	}
+
+	void ShardedSink::Write(const LogRecord &record)
+	{
+		int cpu = record.cpu >= 0 ? record.cpu : CurrentCpu();
+		unsigned index = cpu >= 0 && (size_t) cpu < _shardOf.size() && _shardOf[cpu] != UINT_MAX ?
+			_shardOf[cpu] : (unsigned)(cpu >= 0 ? cpu : record.thread) % (unsigned) _shards.size();
+		Shard &shard = *_shards[index];
+
+		//Sites are static, but arguments and scope names are only valid during the call
+		size_t length = record.length * sizeof(TCHAR);
+		size_t argumentCount = record.site != nullptr ? record.argumentCount : 0;
+		size_t extra = argumentCount * sizeof(LogArgument);
+		for (size_t i = 0; i < argumentCount; ++i)
+		{
+			if (record.arguments[i].type == LogArgument::String)
+				extra += record.arguments[i].s.length;
+		}
+		for (size_t i = 0; i < record.scopeCount; ++i)
+			extra += (_tcsclen(record.scopes[i]) + 1) * sizeof(TCHAR);
+		extra = (extra + 7) & ~(size_t)7;
+		size_t size = QueuedSize(length) + extra;
+		bool urgent = record.level >= _urgentLevel;
+		vector<char> &lane = urgent ? shard.urgent : shard.pending;
+
+		unique_lock<mutex> lock(shard.lock);
+		//An oversize record still goes through, on its own
+		while (!lane.empty() && lane.size() + size > _queueSize)
+			shard.space.wait(lock);
+
+		QueuedRecord queued;
+		queued.timestamp = record.timestamp;
+		if (queued.timestamp == 0)
+		{
+			//Stamped under the shard lock so each shard's records stay in time order
+			timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			queued.timestamp = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+		}
+		queued.thread = record.thread;
+		queued.cpu = cpu;
+		queued.length = (uint32_t) length;
+		queued.level = (uint32_t) record.level;
+		queued.sequence = record.sequence;
+		queued.site = record.site;
+		queued.argumentCount = (uint32_t) argumentCount;
+		queued.scopeCount = (uint32_t) record.scopeCount;
+		queued.extra = (uint32_t) extra;
+
+		bool wasEmpty = lane.empty();
+		size_t offset = lane.size();
+		lane.resize(offset + size);
+		memcpy(&lane[offset], &queued, sizeof(queued));
+		memcpy(&lane[offset + sizeof(queued)], record.message, length);
+
+		//Scope names go before the strings to keep them aligned for TCHAR
+		char *out = &lane[offset + QueuedSize(length)];
+		if (argumentCount != 0)
+			memcpy(out, record.arguments, argumentCount * sizeof(LogArgument));
+		out += argumentCount * sizeof(LogArgument);
+		for (size_t i = 0; i < record.scopeCount; ++i)
+		{
+			size_t bytes = (_tcsclen(record.scopes[i]) + 1) * sizeof(TCHAR);
+			memcpy(out, record.scopes[i], bytes);
+			out += bytes;
+		}
+		for (size_t i = 0; i < argumentCount; ++i)
+		{
+			if (record.arguments[i].type == LogArgument::String)
+			{
+				memcpy(out, record.arguments[i].s.data, record.arguments[i].s.length);
+				out += record.arguments[i].s.length;
+			}
+		}
+		if (urgent)
+			shard.urgentWaiting.store(true, memory_order_relaxed);
+		if (wasEmpty)
+			shard.wake.notify_one();
+	}
+
+	bool ShardedSink::UsesArguments() const
+	{
+		for (const unique_ptr<Shard> &shard : _shards)
+		{
+			if (shard->sink && shard->sink->UsesArguments())
+				return true;
+		}
+		return false;
+	}
+
+	void ShardedSink::Flush()
+	{
+		for (unique_ptr<Shard> &shard : _shards)
+		{
+			unique_lock<mutex> lock(shard->lock);
+			uint64_t ticket = ++shard->flushRequested;
+			shard->wake.notify_one();
+			shard->done.wait(lock, [&] { return shard->flushed >= ticket; });
+		}
+	}
+
+	//Holds every shard's lock across the fork, as well as whatever each destination holds
+	void ShardedSink::PrepareFork()
+	{
+		Flush();
+		for (unique_ptr<Shard> &shard : _shards)
+		{
+			shard->lock.lock();
+			shard->sink->PrepareFork();
+		}
+	}
+
+	void ShardedSink::AfterFork(bool child)
+	{
+		for (size_t i = _shards.size(); i-- > 0; )
+		{
+			Shard &shard = *_shards[i];
+			shard.sink->AfterFork(child);
+			if (child)
+			{
+				//Anything queued or mid-write at the fork is the parent consumer's to write
+				shard.pending.clear();
+				shard.writing.clear();
+				shard.urgent.clear();
+				shard.urgentWriting.clear();
+				shard.urgentWaiting = false;
+				shard.flushed = shard.flushRequested;
+				new (&shard.wake) condition_variable();
+				new (&shard.space) condition_variable();
+				new (&shard.done) condition_variable();
+				new (&shard.consumer) thread();
+				shard.consumer = thread(&ShardedSink::ConsumerLoop, this, ref(shard));
+			}
+			shard.lock.unlock();
+		}
+	}
+
+	void ShardedSink::ConsumerLoop(Shard &shard)
+	{
+#ifdef __linux__
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (int cpu : shard.cpus)
+		{
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &cpus);
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+
+		unique_lock<mutex> lock(shard.lock);
+		//Touched first from the pinned thread, so the queues are allocated on the shard's node
+		shard.pending.reserve(_queueSize);
+		shard.writing.reserve(_queueSize);
+
+		bool dirty = false;
+		chrono::steady_clock::time_point lastFlush = chrono::steady_clock::now();
+		while (true)
+		{
+			if (shard.pending.empty() && shard.urgent.empty() && !shard.stopping && shard.flushRequested == shard.flushed)
+				shard.wake.wait_for(lock, chrono::milliseconds(_flushInterval));
+
+			shard.pending.swap(shard.writing);
+			uint64_t flushTarget = shard.flushRequested;
+			bool stopping = shard.stopping;
+			shard.space.notify_all();
+			lock.unlock();
+
+			//The urgent lane goes first, and again whenever it fills while bulk records are written.
+			//Draining it flushes the destination, which covers the bulk records written so far.
+			for (size_t offset = 0; ; )
+			{
+				if (shard.urgentWaiting.load(memory_order_relaxed) && DrainUrgent(shard))
+					dirty = false;
+				if (offset >= shard.writing.size())
+					break;
+				offset = WriteQueued(shard, shard.writing, offset);
+				dirty = true;
+			}
+			shard.writing.clear();
+
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			if (dirty && (flushTarget != shard.flushed || stopping || now - lastFlush >= chrono::milliseconds(_flushInterval)))
+			{
+				shard.sink->Flush();
+				dirty = false;
+				lastFlush = now;
+			}
+
+			lock.lock();
+			if (flushTarget != shard.flushed)
+			{
+				shard.flushed = flushTarget;
+				shard.done.notify_all();
+			}
+			if (stopping && shard.pending.empty() && shard.urgent.empty())
+				break;
+		}
+	}
+
+	//Hands one queued record to the shard's destination; returns the offset of the next
+	size_t ShardedSink::WriteQueued(Shard &shard, const vector<char> &queue, size_t offset)
+	{
+		QueuedRecord queued;
+		memcpy(&queued, &queue[offset], sizeof(queued));
+
+		//Point the arguments and scopes back at their copies in the queue
+		const char *extra = &queue[offset + QueuedSize(queued.length)];
+		shard.arguments.resize(queued.argumentCount);
+		if (queued.argumentCount != 0)
+			memcpy(&shard.arguments[0], extra, queued.argumentCount * sizeof(LogArgument));
+		extra += queued.argumentCount * sizeof(LogArgument);
+		shard.scopes.resize(queued.scopeCount);
+		for (size_t i = 0; i < queued.scopeCount; ++i)
+		{
+			shard.scopes[i] = (LPCTSTR) extra;
+			extra += (_tcsclen(shard.scopes[i]) + 1) * sizeof(TCHAR);
+		}
+		for (LogArgument &argument : shard.arguments)
+		{
+			if (argument.type == LogArgument::String)
+			{
+				argument.s.data = extra;
+				extra += argument.s.length;
+			}
+		}
+
+		LogRecord record = { (LogLevel) queued.level, (LPCTSTR) &queue[offset + sizeof(queued)], queued.length / sizeof(TCHAR),
+			queued.site, shard.arguments.data(), queued.argumentCount, shard.scopes.data(), queued.scopeCount,
+			queued.thread, queued.cpu, queued.timestamp, queued.sequence };
+		shard.sink->Write(record);
+		return offset + QueuedSize(queued.length) + queued.extra;
+	}
+
+	//Writes out and flushes whatever is in the urgent lane; false if it was empty
+	bool ShardedSink::DrainUrgent(Shard &shard)
+	{
+		{
+			lock_guard<mutex> lock(shard.lock);
+			shard.urgent.swap(shard.urgentWriting);
+			shard.urgentWaiting.store(false, memory_order_relaxed);
+			shard.space.notify_all();
+		}
+		if (shard.urgentWriting.empty())
+			return false;
+
+		for (size_t offset = 0; offset < shard.urgentWriting.size(); )
+			offset = WriteQueued(shard, shard.urgentWriting, offset);
+		shard.urgentWriting.clear();
+		shard.sink->Flush();
+		return true;
+	}
+}
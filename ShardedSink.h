@@ -0,0 +1,105 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+#include <condition_variable>
+#include <functional>
+
+/* Sharded destination
+ * On large machines every thread funnelling into the same destination turns
+ * its lock into the bottleneck. ShardedSink splits the CPUs into shards, one
+ * per NUMA node or, on nodes with more than coresPerShard CPUs, one per group
+ * of that many cores. A record is queued on the shard of the CPU it was logged
+ * on, so threads only contend with their neighbours.
+ *
+ * Each shard has its own consumer thread, pinned to the shard's CPUs, which
+ * hands the queued records to the shard's own destination as created by the
+ * factory; typically a BinaryLogSink or FileSink writing to a file of its own.
+ * Records are timestamped when they're queued. With BinaryLogSink segments the
+ * timestamps are kept, and `logquery -m` merges the segments back into a single
+ * time-ordered stream. The queue keeps a copy of each record's site,
+ * arguments and scope names, so a BinaryLogSink behind it still encodes
+ * NST_LOG records rather than storing their text.
+ *
+ * Each shard queues records in two lanes. Records at urgentLevel and above
+ * (Warn and Error by default) go in the urgent lane, which the consumer
+ * drains first, even in the middle of writing out bulk records, and flushes
+ * right away; so an error isn't held up behind a burst of debug output. The
+ * destination thus sees records out of order. The queue-time timestamps and
+ * LogRecord::sequence (shown with LogSequence) give the original order back:
+ * BinaryLogSink stores both as they are, and `logquery -m` sorts on them.
+ *
+ * Write() blocks while its lane is full. Flush() waits until every shard has
+ * passed everything queued so far to its destination and flushed it.
+ * Across fork() the child gets fresh consumers, and the records still queued
+ * at the time are left to the parent's.
+*/
+
+namespace neosmart
+{
+	class ShardedSink : public LogSink
+	{
+	public:
+		//Creates the destination for one shard
+		typedef std::function<std::unique_ptr<LogSink>(unsigned shard)> Factory;
+
+	private:
+		struct alignas(64) Shard
+		{
+			std::vector<int> cpus;
+			std::unique_ptr<LogSink> sink;
+			std::vector<char> pending;
+			std::vector<char> writing;
+			std::vector<char> urgent;
+			std::vector<char> urgentWriting;
+			//Rebuilt for each record the consumer writes
+			std::vector<LogArgument> arguments;
+			std::vector<LPCTSTR> scopes;
+			//Set while the urgent lane has records the consumer hasn't taken yet
+			std::atomic<bool> urgentWaiting;
+			uint64_t flushRequested;
+			uint64_t flushed;
+			bool stopping;
+
+			std::mutex lock;
+			std::condition_variable wake;
+			std::condition_variable space;
+			std::condition_variable done;
+			std::thread consumer;
+		};
+
+		std::vector<std::unique_ptr<Shard>> _shards;
+		std::vector<unsigned> _shardOf;
+		size_t _queueSize;
+		int _flushInterval;
+		LogLevel _urgentLevel;
+
+		void ConsumerLoop(Shard &shard);
+		size_t WriteQueued(Shard &shard, const std::vector<char> &queue, size_t offset);
+		bool DrainUrgent(Shard &shard);
+
+	public:
+		ShardedSink(Factory factory, unsigned coresPerShard = 16, size_t queueSize = 1024 * 1024, int flushInterval = 100,
+			LogLevel urgentLevel = neosmart::Warn);
+		~ShardedSink();
+
+		unsigned Shards() const { return (unsigned) _shards.size(); }
+		//The CPUs of one shard, as used for pinning its consumer
+		const std::vector<int> &ShardCpus(unsigned shard) const { return _shards[shard]->cpus; }
+
+		//The CPUs of each NUMA node, or all CPUs as one node where that isn't known
+		static std::vector<std::vector<int>> Topology();
+
+		virtual void Write(const LogRecord &record);
+		virtual void Flush();
+		virtual bool UsesArguments() const;
+		virtual void PrepareFork();
+		virtual void AfterFork(bool child);
+	};
+}
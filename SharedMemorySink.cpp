@@ -0,0 +1,204 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "SharedMemorySink.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace neosmart
+{
+	static const char ringMagic[8] = "NSTSHM1";
+
+	static_assert(atomic<uint64_t>::is_always_lock_free, "the ring is shared with other processes");
+
+	static inline SharedMemorySink::Slot *SlotAt(SharedMemorySink::Header *header, uint64_t ticket)
+	{
+		return (SharedMemorySink::Slot *)((char *)(header + 1) + (ticket % header->slotCount) * header->slotSize);
+	}
+
+	SharedMemorySink::SharedMemorySink(size_t records, size_t recordSize, const char *name)
+		: _header(nullptr), _size(0), _records(records), _recordSize(recordSize), _perProcess(name == nullptr), _owner(0)
+	{
+		if (name != nullptr)
+			_name = name;
+		Open();
+	}
+
+	void SharedMemorySink::Open()
+	{
+		_owner = (uint32_t) getpid();
+		if (_perProcess)
+			_name = "/nstlog." + to_string(_owner);
+
+		size_t recordSize = (max(_recordSize, sizeof(Slot) + 1) + 7) & ~(size_t)7;
+		_size = sizeof(Header) + _records * recordSize;
+
+		int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return;
+		if (ftruncate(fd, (off_t)_size) == 0)
+		{
+			void *mapping = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mapping != MAP_FAILED)
+				_header = (Header *) mapping;
+		}
+		close(fd);
+
+		if (_header == nullptr)
+		{
+			shm_unlink(_name.c_str());
+			return;
+		}
+
+		_header->slotSize = (uint32_t) recordSize;
+		_header->slotCount = (uint32_t) _records;
+		_header->pid = _owner;
+		_header->head = 0;
+		_header->tail = 0;
+		_header->dropped = 0;
+		//Publish the magic last; the collector ignores rings until it appears
+		atomic_thread_fence(memory_order_release);
+		memcpy(_header->magic, ringMagic, sizeof(ringMagic));
+	}
+
+	void SharedMemorySink::Close()
+	{
+		if (_header == nullptr)
+			return;
+
+		//Leave undrained rings behind for the collector, which removes them once drained.
+		//A forked child that never got AfterFork() mustn't remove its parent's ring.
+		if (_owner == (uint32_t) getpid() && _header->tail.load() == _header->head.load())
+			shm_unlink(_name.c_str());
+		munmap(_header, _size);
+		_header = nullptr;
+	}
+
+	SharedMemorySink::~SharedMemorySink()
+	{
+		Close();
+	}
+
+	void SharedMemorySink::AfterFork(bool child)
+	{
+		if (!child || _header == nullptr)
+			return;
+
+		//The ring, and the pid in its header, are the parent's
+		munmap(_header, _size);
+		_header = nullptr;
+		if (_perProcess)
+			Open();
+	}
+
+	uint64_t SharedMemorySink::Dropped() const
+	{
+		return _header != nullptr ? _header->dropped.load(memory_order_relaxed) : 0;
+	}
+
+	void SharedMemorySink::Write(const LogRecord &record)
+	{
+		if (_header == nullptr)
+			return;
+
+		uint64_t ticket = _header->head.load(memory_order_relaxed);
+		do
+		{
+			if (ticket - _header->tail.load(memory_order_acquire) >= _header->slotCount)
+			{
+				_header->dropped.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+		} while (!_header->head.compare_exchange_weak(ticket, ticket + 1, memory_order_relaxed));
+
+		//clock_gettime is serviced by the vDSO, so this doesn't enter the kernel either
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		Slot *slot = SlotAt(_header, ticket);
+		size_t length = min(record.length * sizeof(TCHAR), _header->slotSize - sizeof(Slot));
+		slot->timestamp = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+		slot->length = (uint32_t) length;
+		slot->level = (uint32_t) record.level;
+		memcpy((char *)(slot + 1), record.message, length);
+		slot->sequence.store(ticket + 1, memory_order_release);
+	}
+
+	SharedMemoryReader::SharedMemoryReader(const char *name)
+		: _name(name), _header(nullptr), _size(0)
+	{
+		int fd = shm_open(name, O_RDWR, 0);
+		if (fd < 0)
+			return;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0 && (size_t) info.st_size > sizeof(SharedMemorySink::Header))
+		{
+			void *mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mapping != MAP_FAILED)
+			{
+				_header = (SharedMemorySink::Header *) mapping;
+				_size = (size_t) info.st_size;
+			}
+		}
+		close(fd);
+
+		if (_header != nullptr && (memcmp(_header->magic, ringMagic, sizeof(ringMagic)) != 0
+			|| _header->slotCount == 0 || _header->slotSize <= sizeof(SharedMemorySink::Slot)
+			|| sizeof(SharedMemorySink::Header) + (uint64_t) _header->slotCount * _header->slotSize > _size))
+		{
+			munmap(_header, _size);
+			_header = nullptr;
+		}
+		atomic_thread_fence(memory_order_acquire);
+	}
+
+	SharedMemoryReader::~SharedMemoryReader()
+	{
+		if (_header != nullptr)
+			munmap(_header, _size);
+	}
+
+	uint32_t SharedMemoryReader::Pid() const
+	{
+		return _header != nullptr ? _header->pid : 0;
+	}
+
+	size_t SharedMemoryReader::Drain(vector<Entry> &entries)
+	{
+		if (_header == nullptr)
+			return 0;
+
+		size_t count = 0;
+		uint64_t tail = _header->tail.load(memory_order_relaxed);
+		uint64_t head = _header->head.load(memory_order_acquire);
+		for (; tail != head; ++tail, ++count)
+		{
+			//Stop at the first slot still being written to keep per-process order intact
+			SharedMemorySink::Slot *slot = SlotAt(_header, tail);
+			if (slot->sequence.load(memory_order_acquire) != tail + 1)
+				break;
+
+			Entry entry;
+			entry.timestamp = slot->timestamp;
+			entry.pid = _header->pid;
+			entry.level = (LogLevel) slot->level;
+			entry.text.assign((const char *)(slot + 1), min<uint32_t>(slot->length, _header->slotSize - sizeof(SharedMemorySink::Slot)));
+			entries.push_back(entry);
+		}
+		_header->tail.store(tail, memory_order_release);
+		return count;
+	}
+}
+#endif
@@ -0,0 +1,103 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+#include <stdint.h>
+
+/* Shared-memory transport
+ * SharedMemorySink writes each record into a POSIX shared-memory ring owned by
+ * the producing process (/nstlog.<pid> by default). Writing is a CAS on the
+ * ring head and a memcpy; nothing on the hot path enters the kernel, and the
+ * record is dropped (and counted) rather than blocking when the ring is full.
+ *
+ * tools/logcollect attaches to every ring on the host with SharedMemoryReader
+ * and writes one merged stream ordered by the timestamps taken at Write().
+ *
+ * A forked child stops writing to its parent's ring. With the default name it
+ * opens its own /nstlog.<pid>; with an explicit one it stops logging to shared
+ * memory. Only the process that created a ring ever removes it.
+*/
+
+namespace neosmart
+{
+	class SharedMemorySink : public LogSink
+	{
+	public:
+		struct Header
+		{
+			char magic[8];
+			uint32_t slotSize;
+			uint32_t slotCount;
+			uint32_t pid;
+			alignas(64) std::atomic<uint64_t> head;
+			std::atomic<uint64_t> dropped;
+			alignas(64) std::atomic<uint64_t> tail;
+		};
+
+		struct Slot
+		{
+			//Ticket + 1 once the record is complete
+			std::atomic<uint64_t> sequence;
+			uint64_t timestamp;
+			uint32_t length;
+			uint32_t level;
+		};
+
+	private:
+		std::string _name;
+		Header *_header;
+		size_t _size;
+		size_t _records;
+		size_t _recordSize;
+		//Whether the name is the default one for the process, which a forked child replaces
+		bool _perProcess;
+		//The process that created the ring, and alone may remove it
+		uint32_t _owner;
+
+		void Open();
+		void Close();
+
+	public:
+		SharedMemorySink(size_t records = 8192, size_t recordSize = 512, const char *name = nullptr);
+		~SharedMemorySink();
+
+		bool IsOpen() const { return _header != nullptr; }
+		uint64_t Dropped() const;
+
+		virtual void Write(const LogRecord &record);
+		virtual void AfterFork(bool child);
+	};
+
+	//Consumer side of a SharedMemorySink ring, used by the collector
+	class SharedMemoryReader
+	{
+		std::string _name;
+		SharedMemorySink::Header *_header;
+		size_t _size;
+
+	public:
+		struct Entry
+		{
+			uint64_t timestamp;
+			uint32_t pid;
+			LogLevel level;
+			std::string text;
+		};
+
+		SharedMemoryReader(const char *name);
+		~SharedMemoryReader();
+
+		bool IsOpen() const { return _header != nullptr; }
+		const std::string &Name() const { return _name; }
+		uint32_t Pid() const;
+
+		//Appends every completed record and releases their slots to the producer
+		size_t Drain(std::vector<Entry> &entries);
+	};
+}
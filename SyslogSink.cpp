@@ -0,0 +1,241 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#include "SyslogSink.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+namespace neosmart
+{
+	static const int severities[] = { 7, 6, 4, 3, 5 };
+
+	static int Connect(const char *address)
+	{
+		if (address[0] == '/')
+		{
+			sockaddr_un local = {};
+			if (strlen(address) >= sizeof(local.sun_path))
+				return -1;
+			local.sun_family = AF_UNIX;
+			strcpy(local.sun_path, address);
+
+			int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if (fd >= 0 && connect(fd, (sockaddr *) &local, sizeof(local)) != 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+			return fd;
+		}
+
+		const char *colon = strrchr(address, ':');
+		if (colon == nullptr)
+			return -1;
+		string host(address, colon);
+		if (host.size() > 2 && host[0] == '[')
+			host = host.substr(1, host.size() - 2);
+
+		addrinfo hints = {};
+		hints.ai_socktype = SOCK_DGRAM;
+		addrinfo *results;
+		if (getaddrinfo(host.c_str(), colon + 1, &hints, &results) != 0)
+			return -1;
+
+		int fd = -1;
+		for (addrinfo *i = results; i != nullptr && fd < 0; i = i->ai_next)
+		{
+			fd = socket(i->ai_family, i->ai_socktype | SOCK_CLOEXEC, i->ai_protocol);
+			if (fd >= 0 && connect(fd, i->ai_addr, i->ai_addrlen) != 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(results);
+		return fd;
+	}
+
+	SyslogSink::SyslogSink(const char *address, const char *appName, Format format, int facility, size_t batchSize, int flushInterval)
+		: _format(format), _facility(facility), _batchSize(max<size_t>(batchSize, 1)), _recordSize(2048),
+		_dropped(0), _stopping(false), _flushInterval(flushInterval)
+	{
+		_socket = Connect(address);
+
+		char host[256] = "-";
+		gethostname(host, sizeof(host) - 1);
+		_host = host;
+		_app = appName != nullptr ? appName : "-";
+		BuildHeader();
+
+		_batch.resize(_batchSize * _recordSize);
+		_lengths.reserve(_batchSize);
+		_flusher = thread(&SyslogSink::FlushLoop, this);
+	}
+
+	//Everything after the timestamp is the same for every record, so it's built once per process
+	void SyslogSink::BuildHeader()
+	{
+		if (_format == Rfc5424)
+			_header = " " + _host + " " + _app + " " + to_string(getpid()) + " - - ";
+		else
+			_header = "SYSLOG_IDENTIFIER=" + _app + "\nSYSLOG_PID=" + to_string(getpid()) + "\n";
+	}
+
+	SyslogSink::~SyslogSink()
+	{
+		{
+			lock_guard<mutex> lock(_lock);
+			_stopping = true;
+		}
+		_wake.notify_one();
+		_flusher.join();
+
+		Flush();
+		if (_socket >= 0)
+			close(_socket);
+	}
+
+	void SyslogSink::Write(const LogRecord &record)
+	{
+		//Drop the line ending and the level prefix, which the severity already conveys
+		const char *message = record.message;
+		size_t length = record.length;
+		while (length != 0 && (message[length - 1] == '\n' || message[length - 1] == '\r'))
+			--length;
+		size_t prefix = _tcsclen(logPrefixes[record.level]);
+		if (length >= prefix && memcmp(message, logPrefixes[record.level], prefix) == 0)
+		{
+			message += prefix;
+			length -= prefix;
+		}
+
+		lock_guard<mutex> lock(_lock);
+		char *slot = &_batch[_lengths.size() * _recordSize];
+		int used;
+		if (_format == Rfc5424)
+		{
+			timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			tm utc;
+			gmtime_r(&now.tv_sec, &utc);
+			used = snprintf(slot, _recordSize, "<%d>1 %04d-%02d-%02dT%02d:%02d:%02d.%06ldZ%s",
+				_facility * 8 + severities[record.level], utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+				utc.tm_hour, utc.tm_min, utc.tm_sec, now.tv_nsec / 1000, _header.c_str());
+		}
+		else
+			used = snprintf(slot, _recordSize, "PRIORITY=%d\n%sMESSAGE\n", severities[record.level], _header.c_str());
+
+		size_t total = min((size_t) max(used, 0), _recordSize);
+		if (_format == Journal)
+		{
+			//Use the length-prefixed field form so the message may contain newlines
+			length = min(length, _recordSize - min(total + 9, _recordSize));
+			for (int i = 0; i < 8 && total < _recordSize; ++i)
+				slot[total++] = (char)((uint64_t) length >> (8 * i));
+		}
+		size_t copied = min(length, _recordSize - total);
+		memcpy(slot + total, message, copied);
+		total += copied;
+		if (_format == Journal && total < _recordSize)
+			slot[total++] = '\n';
+		_lengths.push_back(total);
+
+		if (_lengths.size() == _batchSize)
+			Send();
+	}
+
+	//Must be called with _lock held
+	void SyslogSink::Send()
+	{
+		if (_lengths.empty())
+			return;
+
+		if (_socket < 0)
+		{
+			_dropped += _lengths.size();
+			_lengths.clear();
+			return;
+		}
+
+		vector<iovec> buffers(_lengths.size());
+		for (size_t i = 0; i < _lengths.size(); ++i)
+		{
+			buffers[i].iov_base = &_batch[i * _recordSize];
+			buffers[i].iov_len = _lengths[i];
+		}
+
+		size_t sent = 0;
+#ifdef __linux__
+		vector<mmsghdr> messages(_lengths.size());
+		for (size_t i = 0; i < _lengths.size(); ++i)
+		{
+			messages[i].msg_hdr = msghdr();
+			messages[i].msg_hdr.msg_iov = &buffers[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		while (sent < messages.size())
+		{
+			int count = sendmmsg(_socket, &messages[sent], (unsigned int)(messages.size() - sent), MSG_DONTWAIT);
+			if (count <= 0)
+				break;
+			sent += (size_t) count;
+		}
+#else
+		for (; sent < buffers.size(); ++sent)
+		{
+			if (send(_socket, buffers[sent].iov_base, buffers[sent].iov_len, MSG_DONTWAIT) < 0)
+				break;
+		}
+#endif
+		_dropped += _lengths.size() - sent;
+		_lengths.clear();
+	}
+
+	void SyslogSink::Flush()
+	{
+		lock_guard<mutex> lock(_lock);
+		Send();
+	}
+
+	//Holds _lock across the fork, with the batch already sent
+	void SyslogSink::PrepareFork()
+	{
+		_lock.lock();
+		Send();
+	}
+
+	void SyslogSink::AfterFork(bool child)
+	{
+		//Datagrams from both processes interleave safely, so the child keeps logging with a flusher of its own
+		if (child)
+		{
+			BuildHeader();
+			new (&_flusher) thread();
+			new (&_wake) condition_variable();
+			_flusher = thread(&SyslogSink::FlushLoop, this);
+		}
+		_lock.unlock();
+	}
+
+	void SyslogSink::FlushLoop()
+	{
+		unique_lock<mutex> lock(_lock);
+		while (!_stopping)
+		{
+			_wake.wait_for(lock, chrono::milliseconds(_flushInterval));
+			Send();
+		}
+	}
+}
+#endif
@@ -0,0 +1,73 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+#pragma once
+
+#include "Log.h"
+#include <condition_variable>
+
+/* Syslog destination
+ * Sends each record as a datagram to a local agent, either as RFC 5424 syslog
+ * or in the systemd journal's native KEY=value format. The address is a socket
+ * path (AF_UNIX, e.g. /dev/log or /run/systemd/journal/socket) or host:port for
+ * UDP. Records are batched and handed to the kernel with one sendmmsg() per
+ * batch; a batch goes out once it is full, after flushInterval milliseconds,
+ * or on Flush(). Sends never block: if the agent falls behind, the batch is
+ * dropped and counted in Dropped().
+ *
+ * LogLevel maps onto syslog severities as Debug=debug, Info=info,
+ * Warn=warning, Error=err and Passthru=notice.
+*/
+
+namespace neosmart
+{
+	class SyslogSink : public LogSink
+	{
+	public:
+		enum Format
+		{
+			Rfc5424,
+			Journal
+		};
+
+	private:
+		int _socket;
+		Format _format;
+		int _facility;
+		std::string _host;
+		std::string _app;
+		std::string _header;
+		size_t _batchSize;
+		size_t _recordSize;
+
+		std::mutex _lock;
+		std::condition_variable _wake;
+		std::vector<char> _batch;
+		std::vector<size_t> _lengths;
+		std::atomic<uint64_t> _dropped;
+		bool _stopping;
+		std::thread _flusher;
+		int _flushInterval;
+
+		void BuildHeader();
+		void Send();
+		void FlushLoop();
+
+	public:
+		SyslogSink(const char *address = "/dev/log", const char *appName = nullptr, Format format = Rfc5424,
+			int facility = 1, size_t batchSize = 32, int flushInterval = 50);
+		~SyslogSink();
+
+		bool IsOpen() const { return _socket >= 0; }
+		uint64_t Dropped() const { return _dropped; }
+
+		virtual void Write(const LogRecord &record);
+		virtual void Flush();
+		virtual void PrepareFork();
+		virtual void AfterFork(bool child);
+	};
+}
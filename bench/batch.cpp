@@ -0,0 +1,116 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Measures logging the same records through a LogBatch and through a loop of
+//Logger::Log() calls, once into an ostringstream and once into a FileSink, and
+//checks both ways produce the same bytes.
+//Build with: c++ -std=c++17 -O2 -I.. batch.cpp ../Log.cpp ../FileSink.cpp -lpthread
+
+#include "../Log.h"
+#include "../FileSink.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+using namespace neosmart;
+using namespace std;
+
+static const char *results[] = { "ok", "retried", "failed" };
+
+static void Loop(Logger &log, int records)
+{
+	for (int n = 0; n < records; ++n)
+		log.Info("item %d: %s %.2f", n, results[n % 3], n * 0.25);
+}
+
+static void Batch(Logger &log, int records)
+{
+	LogBatch batch(log, Info, "item %d: %s %.2f");
+	for (int n = 0; n < records; ++n)
+		batch.Add(n, results[n % 3], n * 0.25);
+}
+
+//Returns milliseconds
+template<typename Run>
+static double Measure(Run run)
+{
+	auto start = chrono::steady_clock::now();
+	run();
+	chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+static string Contents(const char *path)
+{
+	ifstream file(path, ios::binary);
+	return string((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+}
+
+int main(int argc, char *argv[])
+{
+	int records = argc > 1 ? atoi(argv[1]) : 1000000;
+	printf("%-14s %10s %10s\n", "destination", "loop ms", "batch ms");
+
+	{
+		ostringstream loopOutput, batchOutput;
+		Logger log(Debug);
+		log.ClearLogDestinations();
+
+		log.AddLogDestination(loopOutput);
+		double loop = Measure([&] { Loop(log, records); });
+		log.ClearLogDestinations();
+
+		log.AddLogDestination(batchOutput);
+		double batch = Measure([&] { Batch(log, records); });
+		log.ClearLogDestinations();
+
+		if (loopOutput.str() != batchOutput.str())
+		{
+			fprintf(stderr, "FAIL: the batch wrote different text to the ostringstream\n");
+			return 1;
+		}
+		printf("%-14s %10.1f %10.1f\n", "ostringstream", loop, batch);
+	}
+
+	{
+		char loopPath[] = "/tmp/batch.loop.XXXXXX", batchPath[] = "/tmp/batch.batch.XXXXXX";
+		close(mkstemp(loopPath));
+		close(mkstemp(batchPath));
+		Logger log(Debug);
+		log.ClearLogDestinations();
+
+		//Includes the time to hand the last buffers to the kernel, but not to sync them
+		double loop, batch;
+		{
+			FileSink sink(loopPath);
+			log.AddLogDestination(sink);
+			loop = Measure([&] { Loop(log, records); sink.Flush(); });
+			log.RemoveLogDestination(sink);
+		}
+		{
+			FileSink sink(batchPath);
+			log.AddLogDestination(sink);
+			batch = Measure([&] { Batch(log, records); sink.Flush(); });
+			log.RemoveLogDestination(sink);
+		}
+
+		bool same = Contents(loopPath) == Contents(batchPath);
+		unlink(loopPath);
+		unlink(batchPath);
+		if (!same)
+		{
+			fprintf(stderr, "FAIL: the batch wrote different text to the FileSink\n");
+			return 1;
+		}
+		printf("%-14s %10.1f %10.1f\n", "FileSink", loop, batch);
+	}
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Measures the time tinyformat takes per conversion, formatting into a stream that
+//discards its output so only the formatting itself is timed. Build it a second
+//time with -DTINYFORMAT_NO_FAST_PATHS to compare against the operator<< paths.
+//Build with: c++ -std=c++17 -O2 -I.. fmtthroughput.cpp
+
+#include "../tinyformat.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+
+class NullBuffer : public streambuf
+{
+protected:
+	virtual int_type overflow(int_type c) { return traits_type::not_eof(c); }
+	virtual streamsize xsputn(const char *, streamsize count) { return count; }
+};
+
+template<typename T>
+static void Measure(ostream &out, const char *format, const T &value, int iterations)
+{
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+		tfm::format(out, format, value);
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+	printf("%-10s %8.1f ns\n", format, elapsed.count() / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 2000000;
+	NullBuffer buffer;
+	ostream out(&buffer);
+	string text = "a string argument";
+
+	Measure(out, "%d", 123456789, iterations);
+	Measure(out, "% d", 123456789, iterations);
+	Measure(out, "%.8d", -1234, iterations);
+	Measure(out, "%u", 4000000000u, iterations);
+	Measure(out, "%x", 0xdeadbeef, iterations);
+	Measure(out, "%lld", -1234567890123456789ll, iterations);
+	Measure(out, "%f", 3.14159265358979, iterations);
+	Measure(out, "%.3f", 1234.5678, iterations);
+	Measure(out, "%e", 6.02214076e23, iterations);
+	Measure(out, "%g", 0.000123456, iterations);
+	Measure(out, "%s", "a C string", iterations);
+	Measure(out, "%s", text, iterations);
+	Measure(out, "%20s", text, iterations);
+	Measure(out, "%10.4s", text, iterations);
+	return 0;
+}
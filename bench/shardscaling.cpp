@@ -0,0 +1,81 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Measures logging throughput as threads are added, with every thread writing to one
+//locked destination and with the same destination behind a ShardedSink. The
+//destination only counts, so the cost measured is getting records to it.
+//Build with: c++ -std=c++17 -O2 -I.. shardscaling.cpp ../ShardedSink.cpp ../Log.cpp -lpthread
+
+#include "../ShardedSink.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace neosmart;
+using namespace std;
+
+class CountingSink : public LogSink
+{
+	mutex _lock;
+	uint64_t _count;
+
+public:
+	CountingSink() : _count(0) {}
+
+	virtual void Write(const LogRecord &)
+	{
+		lock_guard<mutex> lock(_lock);
+		++_count;
+	}
+	virtual void Flush() {}
+};
+
+//Returns records per second across all threads
+static double Measure(LogSink &sink, unsigned threads, int records)
+{
+	Logger log(Debug);
+	log.ClearLogDestinations();
+	log.AddLogDestination(sink);
+
+	auto start = chrono::steady_clock::now();
+	vector<thread> workers;
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([&log, records] {
+			for (int n = 0; n < records; ++n)
+				log.Info("record %d of %s", n, "a benchmark");
+		});
+	}
+	for (thread &worker : workers)
+		worker.join();
+	sink.Flush();
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+	log.RemoveLogDestination(sink);
+	return threads * (double) records / elapsed.count();
+}
+
+int main(int argc, char *argv[])
+{
+	int records = argc > 1 ? atoi(argv[1]) : 200000;
+	unsigned cpus = max(thread::hardware_concurrency(), 1u);
+
+	printf("%8s %14s %14s\n", "threads", "locked/s", "sharded/s");
+	for (unsigned threads = 1; threads <= cpus; threads *= 2)
+	{
+		CountingSink locked;
+		double direct = Measure(locked, threads, records);
+
+		ShardedSink sharded([](unsigned) { return unique_ptr<LogSink>(new CountingSink()); });
+		double queued = Measure(sharded, threads, records);
+
+		printf("%8u %14.0f %14.0f\n", threads, direct, queued);
+		if (threads < cpus && threads * 2 > cpus)
+			threads = cpus / 2;
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Measures the time from exec to exit of a process that logs one line through the
+//global logger, by running itself over and over. Also counts the static-local
+//guards and call_once()s that logging through the global logger goes through, by
+//interposing __cxa_guard_acquire and pthread_once, and fails if there are any.
+//Build with: c++ -std=c++17 -O2 -I.. startup.cpp ../Log.cpp -lpthread -ldl
+
+#include "../Log.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+extern char **environ;
+
+static atomic<int> guards(0), onces(0);
+
+//Looked up on each call; a function-local static here would take a guard itself
+extern "C" int __cxa_guard_acquire(int64_t *guard)
+{
+	++guards;
+	return ((int (*)(int64_t *)) dlsym(RTLD_NEXT, "__cxa_guard_acquire"))(guard);
+}
+
+extern "C" int pthread_once(pthread_once_t *once, void (*function)())
+{
+	++onces;
+	return ((int (*)(pthread_once_t *, void (*)())) dlsym(RTLD_NEXT, "pthread_once"))(once, function);
+}
+
+//Runs the startup case n times and returns the mean milliseconds from spawn to exit
+static double Measure(const char *self, int runs)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	char child[] = "child";
+	char *arguments[] = { (char *) self, child, nullptr };
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < runs; ++i)
+	{
+		pid_t pid;
+		int status;
+		if (posix_spawn(&pid, self, &actions, nullptr, arguments, environ) != 0 || waitpid(pid, &status, 0) != pid
+			|| !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "FAIL: run %d of the startup case failed\n", i);
+			exit(1);
+		}
+	}
+	chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+	posix_spawn_file_actions_destroy(&actions);
+	return elapsed.count() / runs;
+}
+
+int main(int argc, char *argv[])
+{
+	//The startup case: one line, then exit
+	if (argc > 1 && strcmp(argv[1], "child") == 0)
+	{
+		neosmart::logger.Info("started");
+		return 0;
+	}
+
+	int runs = argc > 1 ? atoi(argv[1]) : 500;
+
+	//Count only what logging itself goes through, not the runtime's own startup
+	int devNull = open("/dev/null", O_WRONLY);
+	int savedStderr = dup(STDERR_FILENO);
+	dup2(devNull, STDERR_FILENO);
+	guards = 0;
+	onces = 0;
+	neosmart::logger.Info("first record");
+	int firstGuards = guards, firstOnces = onces;
+	for (int i = 0; i < 1000; ++i)
+		NST_INFO("record %d", i);
+	neosmart::logger.Flush();
+	dup2(savedStderr, STDERR_FILENO);
+	close(savedStderr);
+	close(devNull);
+
+	printf("guards: %d on the first record, %d in total\n", firstGuards, guards.load());
+	printf("call_once: %d on the first record, %d in total\n", firstOnces, onces.load());
+	printf("exec to exit: %.3f ms (mean of %d runs)\n", Measure(argv[0], runs), runs);
+	if (guards != 0 || onces != 0)
+	{
+		fprintf(stderr, "FAIL: logging through the global logger took a guard or call_once\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Logs from static and thread_local destructors, after the thread's arena is gone.
+//Exits non-zero if a record is lost; a double free aborts. Best run with ASan.
+//Build with: c++ -std=c++17 -fsanitize=address -I.. arenalifetime.cpp ../Log.cpp -lpthread
+
+#include "../Log.h"
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+
+using namespace neosmart;
+
+//Plain storage, so it's still usable from the last destructors
+static int received = 0;
+static char last[64];
+
+class CountingSink : public LogSink
+{
+public:
+	virtual void Write(const LogRecord &record)
+	{
+		++received;
+		size_t length = std::min(record.length, sizeof(last) - 1);
+		memcpy(last, record.message, length);
+		last[length] = '\0';
+	}
+	virtual void Flush() {}
+};
+
+static CountingSink sink;
+
+static void Expect(int count, const char *text)
+{
+	if (received != count || strstr(last, text) == nullptr)
+	{
+		fprintf(stderr, "FAIL: expected %d records ending with \"%s\", got %d, last \"%s\"\n", count, text, received, last);
+		_exit(1);
+	}
+}
+
+struct LogsOnExit
+{
+	~LogsOnExit()
+	{
+		//Twice, so a buffer freed along with the arena would be freed again
+		logger.Info("static destructor %d", 1);
+		logger.Info("static destructor %d", 2);
+		Expect(5, "static destructor 2");
+		printf("ok\n");
+	}
+};
+static LogsOnExit logsOnExit;
+
+struct LogsOnThreadExit
+{
+	~LogsOnThreadExit()
+	{
+		logger.Info("thread_local destructor %d", 1);
+	}
+};
+
+int main()
+{
+	logger.ClearLogDestinations();
+	logger.AddLogDestination(sink, Info);
+
+	std::thread worker([] {
+		static thread_local LogsOnThreadExit logsOnThreadExit;
+		//Sets up the worker's arena before its destructor runs
+		logger.Info("worker %d", 1);
+		(void) &logsOnThreadExit;
+	});
+	worker.join();
+	Expect(2, "thread_local destructor 1");
+
+	logger.Info("main %d", 1);
+	Expect(3, "main 1");
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Formats a fixed corpus of specs and arguments with tinyformat and compares the
+//output byte for byte with fmtcorpus.txt, which holds the output of the operator<<
+//paths. Build it both as is, which checks the fast paths, and with
+//-DTINYFORMAT_NO_FAST_PATHS, which checks the reference itself hasn't moved. After
+//an intended change in output, regenerate the file from the second build with
+//"fmtcorpus -w > fmtcorpus.txt".
+//Build with: c++ -std=c++17 -I.. fmtcorpus.cpp
+
+#define TINYFORMAT_ERROR(reason) ((void) 0)
+#include "../tinyformat.h"
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+static mt19937_64 rng(36);
+static ostringstream corpus;
+
+//Flags, width and precision; the conversion is added by the caller
+static string Spec(bool star)
+{
+	static const char flags[] = "-+ #0";
+	string spec = "%";
+	for (int i = (int)(rng() % 4); i > 0; --i)
+		spec += flags[rng() % 5];
+	if (star)
+		spec += '*';
+	else if (rng() % 3 == 1)
+		spec += to_string(rng() % 25);
+	switch (rng() % 4)
+	{
+		case 1:
+			spec += "." + to_string(rng() % 20);
+			break;
+		case 2:
+			spec += ".";
+			break;
+	}
+	return spec;
+}
+
+template<typename T>
+static void Add(const string &spec, const T &value)
+{
+	corpus << spec << '\t' << '[' << tfm::format(spec.c_str(), value) << ']' << '\n';
+}
+
+template<typename T>
+static void AddStar(const string &spec, int width, const T &value)
+{
+	corpus << spec << ' ' << width << '\t' << '[' << tfm::format(spec.c_str(), width, value) << ']' << '\n';
+}
+
+template<typename T>
+static void AddInteger(T value)
+{
+	static const char conversions[] = "diuoxXsc";
+	//%c only for values that are characters
+	char conversion = conversions[rng() % (sizeof(value) == 1 ? 8 : 7)];
+	if (rng() % 8 == 0)
+		AddStar(Spec(true) + conversion, (int)(rng() % 30) - 15, value);
+	else
+		Add(Spec(false) + conversion, value);
+}
+
+template<typename T>
+static void AddFloat(T value)
+{
+	static const char conversions[] = "fFeEgGs";
+	string spec = Spec(false) + conversions[rng() % 7];
+	//Keep %f of huge values to a readable length
+	if (fabs((double) value) > 1e40 && (spec.back() == 'f' || spec.back() == 'F'))
+		spec.back() = 'e';
+	Add(spec, value);
+}
+
+static void AddStrings()
+{
+	static const char *texts[] = { "", "a", "seven c", "a somewhat longer string argument" };
+	const char *text = texts[rng() % 4];
+	char array[40];
+	strcpy(array, text);
+	string spec = Spec(false) + "s";
+	switch (rng() % 5)
+	{
+		case 0:
+			Add(spec, text);
+			break;
+		case 1:
+			Add(spec, array);
+			break;
+		case 2:
+			Add(spec, string(text));
+			break;
+		case 3:
+			Add(spec, string_view(text));
+			break;
+		case 4:
+			AddStar(Spec(true) + "s", (int)(rng() % 30) - 15, text);
+			break;
+	}
+}
+
+static void Generate()
+{
+	static const double doubles[] = { 0.0, -0.0, 1.0, -1.5, 0.1, 123456.789, 1e300, -1e-300, 5e-324,
+		INFINITY, -INFINITY, NAN, -NAN, 0.5, 2.5, 1e16, 9.999999, 99.95, DBL_MAX };
+	static const long long longs[] = { 0, LLONG_MIN, LLONG_MAX, -1, 1, 9, 10, 99, 100, INT_MIN, INT_MAX };
+
+	//Every extreme with the plain conversions first, then random specs
+	for (long long value : longs)
+	{
+		Add("%d", value);
+		Add("%x", value);
+		Add("%o", value);
+		Add("%u", value);
+		Add("%d", (int) value);
+		Add("%d", (short) value);
+		Add("%u", (unsigned long long) value);
+	}
+	for (double value : doubles)
+	{
+		Add("%f", value);
+		Add("%e", value);
+		Add("%g", value);
+		Add("%s", value);
+		Add("%g", (float) value);
+	}
+	Add("%s", (const char *) nullptr);
+	Add("%d", true);
+
+	for (int i = 0; i < 4000; ++i)
+	{
+		switch (rng() % 12)
+		{
+			case 0:
+				AddInteger((int) rng());
+				break;
+			case 1:
+				AddInteger((int) longs[rng() % (sizeof(longs) / sizeof(longs[0]))]);
+				break;
+			case 2:
+				AddInteger((short) rng());
+				break;
+			case 3:
+				AddInteger((unsigned) rng());
+				break;
+			case 4:
+				AddInteger((long long) rng());
+				break;
+			case 5:
+				AddInteger((unsigned long long) rng());
+				break;
+			case 6:
+				AddInteger((char)('!' + rng() % 90));
+				break;
+			case 7:
+				AddFloat(doubles[rng() % (sizeof(doubles) / sizeof(doubles[0]))]);
+				break;
+			case 8:
+			{
+				uint64_t bits = rng();
+				double value;
+				memcpy(&value, &bits, sizeof(value));
+				AddFloat(value);
+				break;
+			}
+			case 9:
+				AddFloat(ldexp((double)(int64_t) rng(), (int)(rng() % 80) - 60));
+				break;
+			case 10:
+				AddFloat((float) ldexp((double)(int32_t) rng(), (int)(rng() % 40) - 30));
+				break;
+			case 11:
+				AddStrings();
+				break;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Generate();
+	string actual = corpus.str();
+	if (argc > 1 && strcmp(argv[1], "-w") == 0)
+	{
+		fwrite(actual.data(), 1, actual.size(), stdout);
+		return 0;
+	}
+
+	const char *path = argc > 1 ? argv[1] : "fmtcorpus.txt";
+	ifstream file(path, ios::binary);
+	if (!file)
+	{
+		fprintf(stderr, "FAIL: can't read %s\n", path);
+		return 1;
+	}
+	string expected((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	//Report the first line that differs
+	istringstream actualLines(actual), expectedLines(expected);
+	string a, e;
+	for (int line = 1; ; ++line)
+	{
+		bool more = (bool) getline(actualLines, a);
+		bool moreExpected = (bool) getline(expectedLines, e);
+		if (!more && !moreExpected)
+			break;
+		if (more != moreExpected || a != e)
+		{
+			fprintf(stderr, "FAIL: line %d: expected \"%s\", got \"%s\"\n", line, e.c_str(), a.c_str());
+			return 1;
+		}
+	}
+	if (actual != expected)
+	{
+		fprintf(stderr, "FAIL: output differs from %s\n", path);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
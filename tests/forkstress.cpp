@@ -0,0 +1,217 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Forks over and over while other threads log and change the destinations. Each
+//child logs, changes the destinations itself and exits; a child that hangs is
+//killed by its alarm. Also checks that a SyslogSink child sends its own PID, and
+//that a SharedMemorySink child writes to a ring of its own and leaves the parent's.
+//Build with: c++ -std=c++17 -I.. forkstress.cpp ../Log.cpp ../SyslogSink.cpp ../SharedMemorySink.cpp -lpthread -lrt
+
+#include "../Log.h"
+#include "../SyslogSink.h"
+#include "../SharedMemorySink.h"
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using namespace neosmart;
+using namespace std;
+
+class NullSink : public LogSink
+{
+public:
+	virtual void Write(const LogRecord &) {}
+	virtual void Flush() {}
+};
+
+static bool Fail(const string &reason)
+{
+	fprintf(stderr, "FAIL: %s\n", reason.c_str());
+	return false;
+}
+
+//Waits for a child and checks it exited cleanly
+static bool Reap(pid_t child, int round)
+{
+	int status;
+	if (waitpid(child, &status, 0) != child)
+		return Fail("waitpid");
+	if (WIFSIGNALED(status))
+		return Fail("child " + to_string(round) + " killed by signal " + to_string(WTERMSIG(status)));
+	if (WEXITSTATUS(status) != 0)
+		return Fail("child " + to_string(round) + " exited with " + to_string(WEXITSTATUS(status)));
+	return true;
+}
+
+static bool ForkWhileLogging(int rounds)
+{
+	Logger log(Debug);
+	NullSink first, second, childSink;
+	log.ClearLogDestinations();
+	log.AddLogDestination(first);
+
+	atomic<bool> stop(false);
+	vector<thread> threads;
+	for (int i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&log, &stop, i] {
+			for (unsigned n = 0; !stop; ++n)
+				log.Info("thread %d record %u", i, n);
+		});
+	}
+	threads.emplace_back([&log, &stop, &second] {
+		while (!stop)
+		{
+			log.AddLogDestination(second, Warn);
+			log.RemoveLogDestination(second);
+		}
+	});
+
+	bool ok = true;
+	for (int round = 0; round < rounds && ok; ++round)
+	{
+		pid_t child = fork();
+		if (child == 0)
+		{
+			alarm(10);
+			log.Info("child %d", round);
+			log.AddLogDestination(childSink);
+			log.Info("child %d again", round);
+			log.RemoveLogDestination(childSink);
+			log.Flush();
+			_exit(0);
+		}
+		ok = child > 0 ? Reap(child, round) : Fail("fork");
+	}
+
+	stop = true;
+	for (thread &t : threads)
+		t.join();
+	return ok;
+}
+
+static bool SyslogChildPid()
+{
+	char path[] = "/tmp/forkstress.XXXXXX";
+	if (mkdtemp(path) == nullptr)
+		return Fail("mkdtemp");
+	string socketPath = string(path) + "/log";
+
+	int server = socket(AF_UNIX, SOCK_DGRAM, 0);
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath.c_str());
+	if (server < 0 || bind(server, (sockaddr *) &address, sizeof(address)) != 0)
+		return Fail("bind");
+
+	bool ok = true;
+	{
+		Logger log(Debug);
+		SyslogSink sink(socketPath.c_str(), "forkstress", SyslogSink::Rfc5424, 1, 1);
+		log.ClearLogDestinations();
+		log.AddLogDestination(sink);
+
+		pid_t child = fork();
+		if (child == 0)
+		{
+			alarm(10);
+			log.Info("from the child");
+			log.Flush();
+			_exit(0);
+		}
+		ok = child > 0 ? Reap(child, 0) : Fail("fork");
+
+		char datagram[2048];
+		ssize_t length = recv(server, datagram, sizeof(datagram) - 1, 0);
+		if (ok && length <= 0)
+			ok = Fail("no datagram from the child");
+		if (ok)
+		{
+			datagram[length] = '\0';
+			string expected = " forkstress " + to_string(child) + " - - ";
+			if (strstr(datagram, expected.c_str()) == nullptr)
+				ok = Fail(string("child sent the wrong header: ") + datagram);
+		}
+		log.RemoveLogDestination(sink);
+	}
+
+	close(server);
+	unlink(socketPath.c_str());
+	rmdir(path);
+	return ok;
+}
+
+//Whether the ring holds a record containing text
+static bool RingHas(SharedMemoryReader &reader, const char *text)
+{
+	vector<SharedMemoryReader::Entry> entries;
+	reader.Drain(entries);
+	for (const SharedMemoryReader::Entry &entry : entries)
+	{
+		if (entry.text.find(text) != string::npos)
+			return true;
+	}
+	return false;
+}
+
+static bool SharedMemoryChild()
+{
+	Logger log(Debug);
+	SharedMemorySink sink;
+	//Not registered with a logger, so it never hears about the fork
+	SharedMemorySink *unregistered = new SharedMemorySink(16, 512, "/forkstress.unregistered");
+	log.ClearLogDestinations();
+	log.AddLogDestination(sink);
+	string parentRing = "/nstlog." + to_string(getpid());
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+		alarm(10);
+		log.Info("from the child");
+		string childRing = "/nstlog." + to_string(getpid());
+		SharedMemoryReader reader(childRing.c_str());
+		bool ok = reader.IsOpen() && reader.Pid() == (uint32_t) getpid() && RingHas(reader, "from the child");
+		shm_unlink(childRing.c_str());
+		//Drained and destroyed in the child, which must still leave the parent's ring alone
+		delete unregistered;
+		_exit(ok ? 0 : 1);
+	}
+	bool ok = child > 0 ? Reap(child, 0) : Fail("fork");
+	if (!ok)
+		Fail("the child didn't find its record in a ring of its own");
+
+	SharedMemoryReader parent(parentRing.c_str());
+	if (ok && (!parent.IsOpen() || parent.Pid() != (uint32_t) getpid()))
+		ok = Fail("the parent's ring changed");
+	if (ok && RingHas(parent, "from the child"))
+		ok = Fail("the child wrote into the parent's ring");
+	SharedMemoryReader left("/forkstress.unregistered");
+	if (ok && !left.IsOpen())
+		ok = Fail("the child removed a ring it didn't create");
+
+	log.RemoveLogDestination(sink);
+	delete unregistered;
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 500;
+	if (!ForkWhileLogging(rounds) || !SyslogChildPid() || !SharedMemoryChild())
+		return 1;
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Formats through tinyformat's per-thread scratch stream from many short-lived
+//threads and from a thread_local destructor, and checks that every thread's
+//cached buffer is freed when it exits.
+//Build with: c++ -std=c++17 -I.. scratchcache.cpp -lpthread
+
+#include "../tinyformat.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+static std::atomic<long> liveAllocations(0);
+
+void *operator new(size_t size)
+{
+	void *p = malloc(size != 0 ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	++liveAllocations;
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	if (p != nullptr)
+	{
+		--liveAllocations;
+		free(p);
+	}
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+static int failures = 0;
+
+static void Check(const std::string &actual, const char *expected)
+{
+	if (actual != expected)
+	{
+		fprintf(stderr, "FAIL: expected \"%s\", got \"%s\"\n", expected, actual.c_str());
+		++failures;
+	}
+}
+
+struct FormatsOnExit
+{
+	~FormatsOnExit()
+	{
+		//Runs after or before the cache's own destructor; either way it must work
+		Check(tfm::format("[% d|%.2s]", 42, "abc"), "[ 42|ab]");
+	}
+};
+
+int main()
+{
+	//The main thread's own cache is set up first, so it isn't counted
+	Check(tfm::format("% d", 1), " 1");
+	long before = liveAllocations;
+
+	for (int round = 0; round < 8; ++round)
+	{
+		std::vector<std::thread> threads;
+		for (int i = 0; i < 16; ++i)
+		{
+			threads.emplace_back([] {
+				static thread_local FormatsOnExit formatsOnExit;
+				(void) &formatsOnExit;
+				for (int j = 0; j < 100; ++j)
+					Check(tfm::format("% d %.3s", j, "value"), (" " + std::to_string(j) + " val").c_str());
+			});
+		}
+		for (std::thread &thread : threads)
+			thread.join();
+	}
+
+	//128 threads have come and gone; a few allocations of the runtime's own may remain
+	long leaked = liveAllocations - before;
+	if (leaked > 16)
+	{
+		fprintf(stderr, "FAIL: %ld allocations still live after the threads exited\n", leaked);
+		++failures;
+	}
+
+	if (failures == 0)
+		printf("ok\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Points a SyslogSink registered at Warn at a local listener, over a Unix datagram
+//socket in RFC 5424 format and over UDP in journal format, logs one record at each
+//level and checks the listener receives exactly those at and above Warn, in order
+//and with the matching severity.
+//Build with: c++ -std=c++17 -I.. syslogsink.cpp ../Log.cpp ../SyslogSink.cpp -lpthread
+
+#include "../Log.h"
+#include "../SyslogSink.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace neosmart;
+using namespace std;
+
+static bool Fail(const string &reason)
+{
+	fprintf(stderr, "FAIL: %s\n", reason.c_str());
+	return false;
+}
+
+//Collects datagrams until none arrives for a while
+static vector<string> Receive(int listener)
+{
+	vector<string> datagrams;
+	pollfd readable = { listener, POLLIN, 0 };
+	char datagram[4096];
+	while (poll(&readable, 1, 500) > 0)
+	{
+		ssize_t length = recv(listener, datagram, sizeof(datagram), 0);
+		if (length < 0)
+			break;
+		datagrams.emplace_back(datagram, (size_t) length);
+	}
+	return datagrams;
+}
+
+//Logs a record at every level through sink, registered at Warn, and checks what
+//the listener got; prefix builds the part of a datagram that carries the severity
+template<typename Prefix>
+static bool Check(const char *name, SyslogSink &sink, int listener, Prefix prefix)
+{
+	if (!sink.IsOpen())
+		return Fail(string(name) + ": sink did not connect");
+
+	Logger log(Debug);
+	log.ClearLogDestinations();
+	log.AddLogDestination(sink, Warn);
+	log.Debug("debug record");
+	log.Info("info record");
+	log.Warn("warn record");
+	log.Error("error record");
+	log.Passthru("passthru record");
+	log.Flush();
+	log.RemoveLogDestination(sink);
+
+	struct Expected
+	{
+		int severity;
+		const char *text;
+	};
+	static const Expected expected[] = { { 4, "warn record" }, { 3, "error record" }, { 5, "passthru record" } };
+
+	vector<string> datagrams = Receive(listener);
+	if (datagrams.size() != sizeof(expected) / sizeof(expected[0]))
+		return Fail(string(name) + ": received " + to_string(datagrams.size()) + " records, expected 3");
+	for (size_t i = 0; i < datagrams.size(); ++i)
+	{
+		const string &datagram = datagrams[i];
+		if (datagram.compare(0, prefix(expected[i].severity).size(), prefix(expected[i].severity)) != 0)
+			return Fail(string(name) + ": wrong severity in \"" + datagram + "\"");
+		if (datagram.find(expected[i].text) == string::npos)
+			return Fail(string(name) + ": expected \"" + expected[i].text + "\" in \"" + datagram + "\"");
+		if (datagram.find("WARN:") != string::npos || datagram.find("ERROR:") != string::npos)
+			return Fail(string(name) + ": level prefix not stripped from \"" + datagram + "\"");
+	}
+	return true;
+}
+
+static bool UnixRfc5424()
+{
+	char path[] = "/tmp/syslogsink.XXXXXX";
+	if (mkdtemp(path) == nullptr)
+		return Fail("mkdtemp");
+	string socketPath = string(path) + "/log";
+
+	int listener = socket(AF_UNIX, SOCK_DGRAM, 0);
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath.c_str());
+	bool ok = listener >= 0 && bind(listener, (sockaddr *) &address, sizeof(address)) == 0;
+	if (!ok)
+		Fail("bind unix");
+
+	if (ok)
+	{
+		//Facility 1 (user), so the priority is 8 + severity
+		SyslogSink sink(socketPath.c_str(), "syslogsink", SyslogSink::Rfc5424, 1, 2, 10);
+		ok = Check("rfc5424", sink, listener, [](int severity) { return "<" + to_string(8 + severity) + ">1 "; });
+	}
+
+	if (listener >= 0)
+		close(listener);
+	unlink(socketPath.c_str());
+	rmdir(path);
+	return ok;
+}
+
+static bool UdpJournal()
+{
+	int listener = socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	if (listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0
+		|| getsockname(listener, (sockaddr *) &address, &length) != 0)
+	{
+		if (listener >= 0)
+			close(listener);
+		return Fail("bind udp");
+	}
+
+	bool ok;
+	{
+		string target = "127.0.0.1:" + to_string(ntohs(address.sin_port));
+		SyslogSink sink(target.c_str(), "syslogsink", SyslogSink::Journal, 1, 2, 10);
+		ok = Check("journal", sink, listener, [](int severity) { return "PRIORITY=" + to_string(severity) + "\n"; });
+	}
+	close(listener);
+	return ok;
+}
+
+int main()
+{
+	if (!UnixRfc5424() || !UdpJournal())
+		return 1;
+	printf("ok\n");
+	return 0;
+}
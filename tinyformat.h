@@ -134,6 +134,7 @@ namespace tfm = tinyformat;
 // Implementation details.
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 
@@ -147,6 +148,62 @@ namespace tfm = tinyformat;
 #   endif
 #endif
 
+// Reuse one scratch ostringstream per thread for conversions which need to be
+// formatted separately ("% d", "%.3s" of non-strings) instead of constructing
+// a fresh one each time.  Requires thread_local; define
+// TINYFORMAT_NO_SCRATCH_CACHE to opt out.
+#if !defined(TINYFORMAT_NO_SCRATCH_CACHE) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+#   define TINYFORMAT_SCRATCH_CACHE
+#endif
+
+// Write integers, floating point values and strings directly to the stream
+// buffer instead of going through operator<< and the locale's num_put, when
+// the stream uses the classic locale.  The output is the same either way;
+// define TINYFORMAT_NO_FAST_PATHS to always use operator<<.  Changes to the
+// formatting code should be checked with tools/fmtfuzz, built both ways,
+// which compares random specs and arguments against snprintf, and with
+// tests/fmtcorpus, which compares both builds byte for byte against the
+// operator<< output recorded in tests/fmtcorpus.txt.  The known
+// differences from printf, all from formatting by argument type:
+//   * %d of an unsigned value prints it unsigned.
+//   * %x, %o and %u of a negative value print the unsigned value of the
+//     argument's own width, so a short prints as with %hx.
+#if !defined(TINYFORMAT_NO_FAST_PATHS) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+#   define TINYFORMAT_FAST_PATHS
+#endif
+
+#ifdef TINYFORMAT_FAST_PATHS
+#   include <cstdio>
+#   include <cstring>
+#   include <locale>
+#   include <type_traits>
+#   if __cplusplus >= 201703L && defined(__has_include)
+#       if __has_include(<charconv>)
+#           include <charconv>
+#       endif
+#   endif
+#endif
+
+// Wide string arguments (wchar_t, and char16_t/char32_t in C++11) are
+// transcoded to UTF-8 for %s, with invalid sequences replaced by U+FFFD.
+// The ASCII parts are converted 8 characters at a time with SSE2.
+#if defined(TINYFORMAT_ALLOW_WCHAR_STRINGS) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+#   include <type_traits>
+#   if defined(__SSE2__) || defined(_M_X64)
+#       include <emmintrin.h>
+#       define TINYFORMAT_SSE2_TRANSCODE
+#   endif
+#endif
+
+// std::string_view arguments are written directly, and truncated without
+// reading past their end
+#if __cplusplus >= 201703L && defined(__has_include)
+#   if __has_include(<string_view>)
+#       include <string_view>
+#       define TINYFORMAT_HAS_STRING_VIEW
+#   endif
+#endif
+
 #if defined(__GLIBCXX__) && __GLIBCXX__ < 20080201
 //  std::showpos is broken on old libstdc++ as provided with OSX.  See
 //  http://gcc.gnu.org/ml/libstdc++/2007-11/msg00075.html
@@ -261,14 +318,166 @@ struct convertToInt<T,true>
     static int invoke(const T& value) { return static_cast<int>(value); }
 };
 
+// Growable character buffer for ScratchStream; unlike std::stringbuf the
+// contents can be read in place without copying them out into a string.
+class ScratchBuf : public std::streambuf
+{
+    public:
+        ScratchBuf() { reset(); }
+
+        char* data() const { return pbase(); }
+        size_t size() const { return static_cast<size_t>(pptr() - pbase()); }
+        size_t capacity() const { return m_storage.size(); }
+        void reset()
+        {
+            char* begin = m_storage.empty() ? 0 : &m_storage[0];
+            setp(begin, begin + m_storage.size());
+        }
+
+    protected:
+        virtual int_type overflow(int_type c)
+        {
+            if(traits_type::eq_int_type(c, traits_type::eof()))
+                return traits_type::not_eof(c);
+            size_t used = size();
+            m_storage.resize((std::max)(m_storage.size() * 2, static_cast<size_t>(64)));
+            reset();
+            pbump(static_cast<int>(used));
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+            return c;
+        }
+
+    private:
+        std::string m_storage;
+};
+
+// Temporary output stream, starting out empty and in the default state.
+// With TINYFORMAT_SCRATCH_CACHE, each thread keeps one around for reuse;
+// nested use (a value whose operator<< formats with tinyformat) gets its own,
+// and buffers which grew past maxRetained are not kept.
+class ScratchStream
+{
+    private:
+        struct Storage
+        {
+            ScratchBuf buf;
+            std::ostream stream;
+
+            Storage() : stream(&buf) {}
+        };
+
+    public:
+#ifdef TINYFORMAT_SCRATCH_CACHE
+        ScratchStream()
+            : m_storage(0)
+        {
+            Storage** slot = cached();
+            if(slot && *slot)
+            {
+                m_storage = *slot;
+                *slot = 0;
+                std::ostream& out = m_storage->stream;
+                m_storage->buf.reset();
+                out.clear();
+                out.flags(std::ios::dec | std::ios::skipws);
+                out.width(0);
+                out.precision(6);
+                out.fill(' ');
+                if(out.getloc() != std::locale())
+                    out.imbue(std::locale());
+            }
+            else
+                m_storage = new Storage();
+        }
+
+        ~ScratchStream()
+        {
+            Storage** slot = cached();
+            if(slot && !*slot && m_storage->buf.capacity() <= maxRetained)
+                *slot = m_storage;
+            else
+                delete m_storage;
+        }
+
+        std::ostream& stream() { return m_storage->stream; }
+        char* data() const { return m_storage->buf.data(); }
+        size_t size() const { return m_storage->buf.size(); }
+#else
+        std::ostream& stream() { return m_storage.stream; }
+        char* data() const { return m_storage.buf.data(); }
+        size_t size() const { return m_storage.buf.size(); }
+#endif
+
+    private:
+#ifdef TINYFORMAT_SCRATCH_CACHE
+        static const size_t maxRetained = 4096;
+
+        // Owns the thread's cached buffer and frees it when the thread exits
+        struct Cache
+        {
+            Storage* storage;
+
+            Cache() : storage(0) {}
+            ~Cache()
+            {
+                delete storage;
+                storage = 0;
+                destroyed() = true;
+            }
+        };
+
+        static bool& destroyed()
+        {
+            static thread_local bool flag = false;
+            return flag;
+        }
+
+        // The thread's cache slot, or null once the thread is exiting and the
+        // cache is gone; later destructors then get a fresh buffer each time
+        static Storage** cached()
+        {
+            if(destroyed())
+                return 0;
+            static thread_local Cache cache;
+            return &cache.storage;
+        }
+
+        Storage* m_storage;
+#else
+        Storage m_storage;
+#endif
+};
+
+// Write text padded to the stream's width, as operator<< would a string.
+inline void writeAligned(std::ostream& out, const char* s, std::streamsize len)
+{
+    std::streamsize pad = (std::max)(out.width() - len, std::streamsize(0));
+    bool left = (out.flags() & std::ios::adjustfield) == std::ios::left;
+    std::ostream::sentry guard(out);
+    if(guard)
+    {
+        std::streambuf* buf = out.rdbuf();
+        char fill = out.fill();
+        bool ok = true;
+        for(std::streamsize i = 0; ok && !left && i < pad; ++i)
+            ok = !std::char_traits<char>::eq_int_type(buf->sputc(fill), std::char_traits<char>::eof());
+        ok = ok && buf->sputn(s, len) == len;
+        for(std::streamsize i = 0; ok && left && i < pad; ++i)
+            ok = !std::char_traits<char>::eq_int_type(buf->sputc(fill), std::char_traits<char>::eof());
+        if(!ok)
+            out.setstate(std::ios::badbit);
+    }
+    out.width(0);
+}
+
 // Format at most ntrunc characters to the given stream.
 template<typename T>
 inline void formatTruncated(std::ostream& out, const T& value, int ntrunc)
 {
-    std::ostringstream tmp;
-    tmp << value;
-    std::string result = tmp.str();
-    out.write(result.c_str(), (std::min)(ntrunc, static_cast<int>(result.size())));
+    ScratchStream tmp;
+    tmp.stream() << value;
+    writeAligned(out, tmp.data(), (std::min)(ntrunc, static_cast<int>(tmp.size())));
 }
 #define TINYFORMAT_DEFINE_FORMAT_TRUNCATED_CSTR(type)       \
 inline void formatTruncated(std::ostream& out, type* value, int ntrunc) \
@@ -276,13 +485,312 @@ inline void formatTruncated(std::ostream& out, type* value, int ntrunc) \
     std::streamsize len = 0;                                \
     while(len < ntrunc && value[len] != 0)                  \
         ++len;                                              \
-    out.write(value, len);                                  \
+    writeAligned(out, value, len);                        \
 }
 // Overload for const char* and char*.  Could overload for signed & unsigned
 // char too, but these are technically unneeded for printf compatibility.
 TINYFORMAT_DEFINE_FORMAT_TRUNCATED_CSTR(const char)
 TINYFORMAT_DEFINE_FORMAT_TRUNCATED_CSTR(char)
 #undef TINYFORMAT_DEFINE_FORMAT_TRUNCATED_CSTR
+// Strings know their length, so there's nothing to format first
+inline void formatTruncated(std::ostream& out, const std::string& value, int ntrunc)
+{
+    writeAligned(out, value.data(), static_cast<std::streamsize>((std::min)(static_cast<size_t>(ntrunc), value.size())));
+}
+#ifdef TINYFORMAT_HAS_STRING_VIEW
+inline void formatTruncated(std::ostream& out, const std::string_view& value, int ntrunc)
+{
+    writeAligned(out, value.data(), static_cast<std::streamsize>((std::min)(static_cast<size_t>(ntrunc), value.size())));
+}
+#endif
+
+// Write nan and inf as printf does, where num_put would zero pad them under
+// the 0 flag and keep them in lower case for %F.
+template<typename T>
+inline bool formatNonFinite(std::ostream&, const T&) { return false; }
+#define TINYFORMAT_DEFINE_FORMAT_NON_FINITE(type)           \
+inline bool formatNonFinite(std::ostream& out, type value)  \
+{                                                           \
+    if(std::isfinite(value))                                \
+        return false;                                       \
+    bool upper = (out.flags() & std::ios::uppercase) != 0;  \
+    const char* name = std::isnan(value) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf"); \
+    char text[4];                                           \
+    std::streamsize len = 0;                                \
+    if(std::signbit(value))                                 \
+        text[len++] = '-';                                  \
+    else if(out.flags() & std::ios::showpos)                \
+        text[len++] = '+';                                  \
+    for(int i = 0; i < 3; ++i)                              \
+        text[len++] = name[i];                              \
+    out.fill(' ');                                          \
+    writeAligned(out, text, len);                           \
+    return true;                                            \
+}
+TINYFORMAT_DEFINE_FORMAT_NON_FINITE(float)
+TINYFORMAT_DEFINE_FORMAT_NON_FINITE(double)
+TINYFORMAT_DEFINE_FORMAT_NON_FINITE(long double)
+#undef TINYFORMAT_DEFINE_FORMAT_NON_FINITE
+
+#ifdef TINYFORMAT_FAST_PATHS
+// Fast paths for formatValue().  Each mirrors what operator<< would write for
+// the current stream state: num_put's sign, base prefix and padding rules for
+// numbers, plain padding for strings.  Locale dependent output (digit
+// grouping, decimal point) is only known for the classic locale; other
+// streams go through operator<< as usual.
+inline bool hasClassicLocale(const std::ostream& out)
+{
+    return out.getloc() == std::locale::classic();
+}
+
+// Write [s, s+len) the way the stream's padding rules would, honouring and
+// then resetting the width.  For numbers, internal padding goes after any
+// sign or 0x prefix.
+inline void writePadded(std::ostream& out, const char* s, size_t len, bool numeric)
+{
+    std::streambuf* buf = out.rdbuf();
+    std::streamsize width = out.width();
+    size_t pad = width > 0 && static_cast<size_t>(width) > len ? static_cast<size_t>(width) - len : 0;
+    std::ios::fmtflags adjust = out.flags() & std::ios::adjustfield;
+    bool ok = true;
+    if(pad == 0)
+        ok = buf->sputn(s, static_cast<std::streamsize>(len)) == static_cast<std::streamsize>(len);
+    else
+    {
+        // Length of the part written before the padding
+        size_t before = adjust == std::ios::left ? len : 0;
+        if(adjust == std::ios::internal && numeric)
+        {
+            if(len > 0 && (s[0] == '-' || s[0] == '+'))
+                before = 1;
+            else if(len > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+                before = 2;
+        }
+        char fill = out.fill();
+        ok = buf->sputn(s, static_cast<std::streamsize>(before)) == static_cast<std::streamsize>(before);
+        for(size_t i = 0; ok && i < pad; ++i)
+            ok = !std::char_traits<char>::eq_int_type(buf->sputc(fill), std::char_traits<char>::eof());
+        std::streamsize rest = static_cast<std::streamsize>(len - before);
+        ok = ok && buf->sputn(s + before, rest) == rest;
+    }
+    out.width(0);
+    if(!ok)
+        out.setstate(std::ios::badbit);
+}
+
+template<typename T>
+inline bool formatInteger(std::ostream& out, T value)
+{
+    typedef typename std::make_unsigned<T>::type U;
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    if(!hasClassicLocale(out))
+        return false;
+    std::ostream::sentry guard(out);
+    if(!guard)
+        return true;
+
+    std::ios::fmtflags flags = out.flags();
+    std::ios::fmtflags base = flags & std::ios::basefield;
+    char buf[3*sizeof(T) + 4];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    U u = static_cast<U>(value);
+    if(base == std::ios::hex)
+    {
+        // Negative values print as their unsigned counterpart, as with printf
+        const char* digits = (flags & std::ios::uppercase) ? "0123456789ABCDEF" : "0123456789abcdef";
+        do { *--p = digits[u & 15]; u >>= 4; } while(u != 0);
+        if((flags & std::ios::showbase) && value != 0)
+        {
+            *--p = (flags & std::ios::uppercase) ? 'X' : 'x';
+            *--p = '0';
+        }
+    }
+    else if(base == std::ios::oct)
+    {
+        do { *--p = static_cast<char>('0' + (u & 7)); u >>= 3; } while(u != 0);
+        if((flags & std::ios::showbase) && value != 0)
+            *--p = '0';
+    }
+    else
+    {
+        bool negative = value < 0;
+        if(negative)
+            u = static_cast<U>(U(0) - u);
+        while(u >= 100)
+        {
+            const char* pair = pairs + 2*(u % 100);
+            u /= 100;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        if(u >= 10)
+        {
+            const char* pair = pairs + 2*u;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        else
+            *--p = static_cast<char>('0' + u);
+        // Like num_put, only signed types get a '+' from showpos
+        if(negative)
+            *--p = '-';
+        else if((flags & std::ios::showpos) && std::is_signed<T>::value)
+            *--p = '+';
+    }
+    writePadded(out, p, static_cast<size_t>(end - p), true);
+    return true;
+}
+
+inline bool formatFloat(std::ostream& out, double value)
+{
+    if(!hasClassicLocale(out))
+        return false;
+
+    std::ios::fmtflags flags = out.flags();
+    std::ios::fmtflags floatField = flags & std::ios::floatfield;
+    // Hex floats aren't worth a fast path
+    if(floatField == (std::ios::fixed | std::ios::scientific))
+        return false;
+
+    int precision = static_cast<int>(out.precision());
+    if(precision < 0)
+        precision = 6;
+    // Same conversion num_put uses: fixed is always 'f', the others follow
+    // the uppercase flag
+    char conversion = floatField == std::ios::fixed ? 'f' :
+                      floatField == std::ios::scientific ? 'e' : 'g';
+    bool upper = conversion != 'f' && (flags & std::ios::uppercase);
+
+    char buf[64];
+    int len = -1;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    if(!(flags & std::ios::showpoint))
+    {
+        char* p = buf;
+        if((flags & std::ios::showpos) && !std::signbit(value))
+            *p++ = '+';
+        std::chars_format format = conversion == 'f' ? std::chars_format::fixed :
+                                   conversion == 'e' ? std::chars_format::scientific :
+                                   std::chars_format::general;
+        std::to_chars_result result = std::to_chars(p, buf + sizeof(buf), value, format, precision);
+        if(result.ec == std::errc())
+            len = static_cast<int>(result.ptr - buf);
+    }
+    else
+#endif
+    {
+        char spec[8];
+        char* f = spec;
+        *f++ = '%';
+        if(flags & std::ios::showpos)
+            *f++ = '+';
+        if(flags & std::ios::showpoint)
+            *f++ = '#';
+        *f++ = '.';
+        *f++ = '*';
+        *f++ = conversion;
+        *f = '\0';
+        len = std::snprintf(buf, sizeof(buf), spec, precision, value);
+    }
+    // Too long for the buffer (huge %f values): let the stream deal with it
+    if(len < 0 || len >= static_cast<int>(sizeof(buf)))
+        return false;
+    if(upper)
+    {
+        for(int i = 0; i < len; ++i)
+            if(buf[i] >= 'a' && buf[i] <= 'z')
+                buf[i] = static_cast<char>(buf[i] - 'a' + 'A');
+    }
+    std::ostream::sentry guard(out);
+    if(guard)
+        writePadded(out, buf, static_cast<size_t>(len), true);
+    return true;
+}
+
+inline bool formatString(std::ostream& out, const char* s, size_t len)
+{
+    std::ostream::sentry guard(out);
+    if(guard)
+        writePadded(out, s, len, false);
+    return true;
+}
+
+// Dispatch on the exact argument type; everything else returns false and is
+// written with operator<<.
+template<typename T>
+struct FastFormat
+{
+    static bool invoke(std::ostream&, const T&) { return false; }
+};
+#define TINYFORMAT_DEFINE_FAST_FORMAT(type, expr)                 \
+template<>                                                        \
+struct FastFormat<type>                                           \
+{                                                                 \
+    static bool invoke(std::ostream& out, type const& value)      \
+    {                                                             \
+        return expr;                                              \
+    }                                                             \
+};
+TINYFORMAT_DEFINE_FAST_FORMAT(short, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(unsigned short, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(int, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(unsigned int, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(long, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(unsigned long, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(long long, formatInteger(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(unsigned long long, formatInteger(out, value))
+// operator<<(float) also formats the value as a double
+TINYFORMAT_DEFINE_FAST_FORMAT(float, formatFloat(out, value))
+TINYFORMAT_DEFINE_FAST_FORMAT(double, formatFloat(out, value))
+// Null pointers are left to operator<<, which sets badbit
+TINYFORMAT_DEFINE_FAST_FORMAT(const char*, value && formatString(out, value, std::strlen(value)))
+TINYFORMAT_DEFINE_FAST_FORMAT(char*, value && formatString(out, value, std::strlen(value)))
+TINYFORMAT_DEFINE_FAST_FORMAT(std::string, formatString(out, value.data(), value.size()))
+#ifdef TINYFORMAT_HAS_STRING_VIEW
+TINYFORMAT_DEFINE_FAST_FORMAT(std::string_view, formatString(out, value.data(), value.size()))
+#endif
+#undef TINYFORMAT_DEFINE_FAST_FORMAT
+template<size_t N>
+struct FastFormat<char[N]>
+{
+    static bool invoke(std::ostream& out, const char (&value)[N])
+    {
+        return formatString(out, value, std::strlen(value));
+    }
+};
+#endif
+
+// %u of a negative value prints its unsigned counterpart, as %x and %o do
+template<typename T>
+inline void formatAsUnsigned(std::ostream& out, T value)
+{
+#ifdef TINYFORMAT_FAST_PATHS
+    if(FastFormat<T>::invoke(out, value))
+        return;
+#endif
+    out << value;
+}
+template<typename T>
+inline bool formatUnsigned(std::ostream&, const T&) { return false; }
+#define TINYFORMAT_DEFINE_FORMAT_UNSIGNED(type)                 \
+inline bool formatUnsigned(std::ostream& out, type value)       \
+{                                                               \
+    if(value >= 0)                                              \
+        return false;                                           \
+    formatAsUnsigned(out, static_cast<unsigned type>(value));   \
+    return true;                                                \
+}
+TINYFORMAT_DEFINE_FORMAT_UNSIGNED(short)
+TINYFORMAT_DEFINE_FORMAT_UNSIGNED(int)
+TINYFORMAT_DEFINE_FORMAT_UNSIGNED(long)
+#if __cplusplus >= 201103L || defined(_MSC_VER)
+TINYFORMAT_DEFINE_FORMAT_UNSIGNED(long long)
+#endif
+#undef TINYFORMAT_DEFINE_FORMAT_UNSIGNED
 
 } // namespace detail
 
@@ -324,6 +832,7 @@ inline void formatValue(std::ostream& out, const char* /*fmtBegin*/,
         detail::formatValueAsType<T, char>::invoke(out, value);
     else if(canConvertToVoidPtr && *(fmtEnd-1) == 'p')
         detail::formatValueAsType<T, const void*>::invoke(out, value);
+    else if(*(fmtEnd-1) == 'u' && detail::formatUnsigned(out, value)) /**/;
 #ifdef TINYFORMAT_OLD_LIBSTDCPLUSPLUS_WORKAROUND
     else if(detail::formatZeroIntegerWorkaround<T>::invoke(out, value)) /**/;
 #endif
@@ -333,6 +842,10 @@ inline void formatValue(std::ostream& out, const char* /*fmtBegin*/,
         // "%.4s" where at most 4 characters may be read.
         detail::formatTruncated(out, value, ntrunc);
     }
+    else if(detail::formatNonFinite(out, value)) /**/;
+#ifdef TINYFORMAT_FAST_PATHS
+    else if(detail::FastFormat<T>::invoke(out, value)) /**/;
+#endif
     else
         out << value;
 }
@@ -358,6 +871,229 @@ TINYFORMAT_DEFINE_FORMATVALUE_CHAR(unsigned char)
 #undef TINYFORMAT_DEFINE_FORMATVALUE_CHAR
 
 
+#ifdef TINYFORMAT_ALLOW_WCHAR_STRINGS
+namespace detail {
+
+// Decode one code point from a UTF-16 or UTF-32 string, depending on the
+// size of CharT.  Unpaired surrogates and values outside the Unicode range
+// come back as U+FFFD.
+template<typename CharT>
+inline unsigned long decodeWide(const CharT*& s, const CharT* end)
+{
+    unsigned long c = sizeof(CharT) == 2 ? static_cast<unsigned short>(*s)
+                                         : static_cast<unsigned long>(*s);
+    ++s;
+    if(c >= 0xD800 && c <= 0xDFFF)
+    {
+        if(sizeof(CharT) == 2 && c <= 0xDBFF && s != end)
+        {
+            unsigned long low = static_cast<unsigned short>(*s);
+            if(low >= 0xDC00 && low <= 0xDFFF)
+            {
+                ++s;
+                return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+            }
+        }
+        return 0xFFFD;
+    }
+    return c > 0x10FFFF ? 0xFFFD : c;
+}
+
+inline int utf8Length(unsigned long c)
+{
+    return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+inline char* encodeUtf8(unsigned long c, char* out)
+{
+    if(c < 0x80)
+        *out++ = static_cast<char>(c);
+    else if(c < 0x800)
+    {
+        *out++ = static_cast<char>(0xC0 | (c >> 6));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else if(c < 0x10000)
+    {
+        *out++ = static_cast<char>(0xE0 | (c >> 12));
+        *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        *out++ = static_cast<char>(0xF0 | (c >> 18));
+        *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+    return out;
+}
+
+#ifdef TINYFORMAT_SSE2_TRANSCODE
+// Convert 8 characters if they're all ASCII
+inline bool asciiBlock(const char16_t* s, char* out)
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    __m128i high = _mm_and_si128(v, _mm_set1_epi16(static_cast<short>(0xFF80)));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF)
+        return false;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(v, v));
+    return true;
+}
+
+inline bool asciiBlock(const char32_t* s, char* out)
+{
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4));
+    __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi32(~0x7F));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128())) != 0xFFFF)
+        return false;
+    __m128i words = _mm_packs_epi32(a, b);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(words, words));
+    return true;
+}
+
+template<typename CharT>
+inline bool asciiBlock(const CharT* s, char* out)
+{
+    typedef typename std::conditional<sizeof(CharT) == 2, char16_t, char32_t>::type Unit;
+    return asciiBlock(reinterpret_cast<const Unit*>(s), out);
+}
+#endif
+
+// Transcode as many whole characters from [s, end) as fit in [out, outEnd),
+// advancing s.  Returns the end of the output.
+template<typename CharT>
+inline char* transcodeUtf8(const CharT*& s, const CharT* end, char* out, char* outEnd)
+{
+    while(s != end)
+    {
+#ifdef TINYFORMAT_SSE2_TRANSCODE
+        if(end - s >= 8 && outEnd - out >= 8 && asciiBlock(s, out))
+        {
+            s += 8;
+            out += 8;
+            continue;
+        }
+#endif
+        const CharT* next = s;
+        unsigned long c = decodeWide(next, end);
+        if(outEnd - out < utf8Length(c))
+            break;
+        out = encodeUtf8(c, out);
+        s = next;
+    }
+    return out;
+}
+
+// Write a wide string as UTF-8, padded to the stream width like a narrow
+// string.  ntrunc >= 0 limits the output to that many bytes, as printf does
+// for %.Nls, without splitting a character.
+template<typename CharT>
+inline void formatWideString(std::ostream& out, const CharT* s, size_t len, int ntrunc)
+{
+    std::ostream::sentry guard(out);
+    if(!guard)
+        return;
+
+    const CharT* end = s + len;
+    size_t limit = ntrunc >= 0 ? static_cast<size_t>(ntrunc) : static_cast<size_t>(-1);
+    std::streamsize width = out.width();
+    size_t pad = 0;
+    if(width > 0)
+    {
+        size_t total = 0;
+        for(const CharT* p = s; p != end; )
+        {
+            size_t n = static_cast<size_t>(utf8Length(decodeWide(p, end)));
+            if(total + n > limit)
+                break;
+            total += n;
+        }
+        pad = static_cast<size_t>(width) > total ? static_cast<size_t>(width) - total : 0;
+    }
+    out.width(0);
+
+    std::streambuf* buf = out.rdbuf();
+    bool left = (out.flags() & std::ios::adjustfield) == std::ios::left;
+    bool ok = true;
+    for(size_t i = 0; ok && !left && i < pad; ++i)
+        ok = !std::char_traits<char>::eq_int_type(buf->sputc(out.fill()), std::char_traits<char>::eof());
+    char chunk[256];
+    for(size_t written = 0; ok && s != end && written < limit; )
+    {
+        char* chunkEnd = chunk + (std::min)(sizeof(chunk), limit - written);
+        char* last = transcodeUtf8(s, end, chunk, chunkEnd);
+        if(last == chunk)
+            break;
+        ok = buf->sputn(chunk, last - chunk) == last - chunk;
+        written += static_cast<size_t>(last - chunk);
+    }
+    for(size_t i = 0; ok && left && i < pad; ++i)
+        ok = !std::char_traits<char>::eq_int_type(buf->sputc(out.fill()), std::char_traits<char>::eof());
+    if(!ok)
+        out.setstate(std::ios::badbit);
+}
+
+template<typename CharT>
+inline void formatWidePointer(std::ostream& out, const char* fmtEnd, int ntrunc, const CharT* value)
+{
+    // Only %s converts; anything else prints the pointer as before
+    if(*(fmtEnd-1) == 's' && value)
+    {
+        size_t len = 0;
+        while(value[len] != 0)
+            ++len;
+        formatWideString(out, value, len, ntrunc);
+    }
+    else
+        out << static_cast<const void*>(value);
+}
+
+} // namespace detail
+
+#define TINYFORMAT_DEFINE_FORMATVALUE_WIDE(charType)                                   \
+inline void formatValue(std::ostream& out, const char* /*fmtBegin*/,                   \
+                        const char* fmtEnd, int ntrunc, const charType* value)         \
+{                                                                                      \
+    detail::formatWidePointer(out, fmtEnd, ntrunc, value);                             \
+}                                                                                      \
+inline void formatValue(std::ostream& out, const char* /*fmtBegin*/,                   \
+                        const char* fmtEnd, int ntrunc, charType* value)               \
+{                                                                                      \
+    detail::formatWidePointer(out, fmtEnd, ntrunc, value);                             \
+}                                                                                      \
+template<size_t N>                                                                     \
+inline void formatValue(std::ostream& out, const char* /*fmtBegin*/,                   \
+                        const char* fmtEnd, int ntrunc, const charType (&value)[N])    \
+{                                                                                      \
+    detail::formatWidePointer(out, fmtEnd, ntrunc, &value[0]);                         \
+}                                                                                      \
+inline void formatValue(std::ostream& out, const char* /*fmtBegin*/,                   \
+                        const char* /*fmtEnd*/, int ntrunc,                            \
+                        const std::basic_string<charType>& value)                      \
+{                                                                                      \
+    detail::formatWideString(out, value.data(), value.size(), ntrunc);                 \
+}
+TINYFORMAT_DEFINE_FORMATVALUE_WIDE(wchar_t)
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+TINYFORMAT_DEFINE_FORMATVALUE_WIDE(char16_t)
+TINYFORMAT_DEFINE_FORMATVALUE_WIDE(char32_t)
+#endif
+#undef TINYFORMAT_DEFINE_FORMATVALUE_WIDE
+
+#ifdef TINYFORMAT_HAS_STRING_VIEW
+template<typename CharT>
+inline typename std::enable_if<!std::is_same<CharT, char>::value>::type
+formatValue(std::ostream& out, const char* /*fmtBegin*/, const char* /*fmtEnd*/,
+            int ntrunc, const std::basic_string_view<CharT>& value)
+{
+    detail::formatWideString(out, value.data(), value.size(), ntrunc);
+}
+#endif
+#endif // TINYFORMAT_ALLOW_WCHAR_STRINGS
+
+
 //------------------------------------------------------------------------------
 // Tools for emulating variadic templates in C++98.  The basic idea here is
 // stolen from the boost preprocessor metaprogramming library and cut down to
@@ -568,18 +1304,44 @@ inline const char* printFormatStringLiteral(std::ostream& out, const char* fmt)
 }
 
 
-// Parse a format string and set the stream state accordingly.
+// The parts of the stream state which a format spec controls.  Specs are
+// parsed into one of these first and only then applied to the stream, which
+// lets applyStreamState() skip whatever the stream already has.
+struct StreamState
+{
+    std::ios::fmtflags flags;
+    std::streamsize width;
+    std::streamsize precision;
+    char fill;
+};
+
+// Bring the stream state in line with state, touching only what differs.
+inline void applyStreamState(std::ostream& out, const StreamState& state)
+{
+    if(out.flags() != state.flags)
+        out.flags(state.flags);
+    if(out.precision() != state.precision)
+        out.precision(state.precision);
+    if(out.fill() != state.fill)
+        out.fill(state.fill);
+    out.width(state.width);
+}
+
+// Parse a format string and set the stream state accordingly.  state should
+// start out as the stream's current state; only the parts a spec controls
+// are changed.
 //
 // The format mini-language recognized here is meant to be the one from C99,
 // with the form "%[flags][width][.precision][length]type".
 //
 // Formatting options which can't be natively represented using the ostream
-// state are returned in spacePadPositive (for space padded positive numbers)
-// and ntrunc (for truncating conversions).  argIndex is incremented if
+// state are returned in spacePadPositive (for space padded positive numbers),
+// ntrunc (for truncating conversions) and digits (the minimum number of
+// digits for integer conversions, or -1).  argIndex is incremented if
 // necessary to pull out variable width and precision .  The function returns a
 // pointer to the character after the end of the current format spec.
-inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositive,
-                                         int& ntrunc, const char* fmtStart,
+inline const char* streamStateFromFormat(StreamState& state, bool& spacePadPositive,
+                                         int& ntrunc, int& digits, const char* fmtStart,
                                          const detail::FormatArg* formatters,
                                          int& argIndex, int numFormatters)
 {
@@ -589,16 +1351,14 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
         return fmtStart;
     }
     // Reset stream state to defaults.
-    out.width(0);
-    out.precision(6);
-    out.fill(' ');
+    state.width = 0;
+    state.precision = 6;
+    state.fill = ' ';
     // Reset most flags; ignore irrelevant unitbuf & skipws.
-    out.unsetf(std::ios::adjustfield | std::ios::basefield |
-               std::ios::floatfield | std::ios::showbase | std::ios::boolalpha |
-               std::ios::showpoint | std::ios::showpos | std::ios::uppercase);
+    state.flags &= ~(std::ios::adjustfield | std::ios::basefield |
+                   std::ios::floatfield | std::ios::showbase | std::ios::boolalpha |
+                   std::ios::showpoint | std::ios::showpos | std::ios::uppercase);
     bool precisionSet = false;
-    bool widthSet = false;
-    int widthExtra = 0;
     const char* c = fmtStart + 1;
     // 1) Parse flags
     for(;; ++c)
@@ -606,31 +1366,30 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
         switch(*c)
         {
             case '#':
-                out.setf(std::ios::showpoint | std::ios::showbase);
+                state.flags |= std::ios::showpoint | std::ios::showbase;
                 continue;
             case '0':
                 // overridden by left alignment ('-' flag)
-                if(!(out.flags() & std::ios::left))
+                if(!(state.flags & std::ios::left))
                 {
                     // Use internal padding so that numeric values are
                     // formatted correctly, eg -00010 rather than 000-10
-                    out.fill('0');
-                    out.setf(std::ios::internal, std::ios::adjustfield);
+                    state.fill = '0';
+                    state.flags = (state.flags & ~(std::ios::adjustfield)) | std::ios::internal;
                 }
                 continue;
             case '-':
-                out.fill(' ');
-                out.setf(std::ios::left, std::ios::adjustfield);
+                state.fill = ' ';
+                state.flags = (state.flags & ~(std::ios::adjustfield)) | std::ios::left;
                 continue;
             case ' ':
                 // overridden by show positive sign, '+' flag.
-                if(!(out.flags() & std::ios::showpos))
+                if(!(state.flags & std::ios::showpos))
                     spacePadPositive = true;
                 continue;
             case '+':
-                out.setf(std::ios::showpos);
+                state.flags |= std::ios::showpos;
                 spacePadPositive = false;
-                widthExtra = 1;
                 continue;
             default:
                 break;
@@ -639,13 +1398,9 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
     }
     // 2) Parse width
     if(*c >= '0' && *c <= '9')
-    {
-        widthSet = true;
-        out.width(parseIntAndAdvance(c));
-    }
+        state.width = parseIntAndAdvance(c);
     if(*c == '*')
     {
-        widthSet = true;
         int width = 0;
         if(argIndex < numFormatters)
             width = formatters[argIndex++].toInt();
@@ -654,11 +1409,11 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
         if(width < 0)
         {
             // negative widths correspond to '-' flag set
-            out.fill(' ');
-            out.setf(std::ios::left, std::ios::adjustfield);
+            state.fill = ' ';
+            state.flags = (state.flags & ~(std::ios::adjustfield)) | std::ios::left;
             width = -width;
         }
-        out.width(width);
+        state.width = width;
         ++c;
     }
     // 3) Parse precision
@@ -681,7 +1436,7 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
             else if(*c == '-') // negative precisions ignored, treated as zero.
                 parseIntAndAdvance(++c);
         }
-        out.precision(precision);
+        state.precision = precision;
         precisionSet = true;
     }
     // 4) Ignore any C99 length modifier
@@ -695,40 +1450,46 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
     switch(*c)
     {
         case 'u': case 'd': case 'i':
-            out.setf(std::ios::dec, std::ios::basefield);
+            state.flags = (state.flags & ~(std::ios::basefield)) | std::ios::dec;
+            // Unsigned conversions have no sign to show
+            if(*c == 'u')
+            {
+                state.flags &= ~std::ios::showpos;
+                spacePadPositive = false;
+            }
             intConversion = true;
             break;
         case 'o':
-            out.setf(std::ios::oct, std::ios::basefield);
+            state.flags = (state.flags & ~(std::ios::basefield)) | std::ios::oct;
             intConversion = true;
             break;
         case 'X':
-            out.setf(std::ios::uppercase);
+            state.flags |= std::ios::uppercase;
             // Falls through
         case 'x': case 'p':
-            out.setf(std::ios::hex, std::ios::basefield);
+            state.flags = (state.flags & ~(std::ios::basefield)) | std::ios::hex;
             intConversion = true;
             break;
         case 'E':
-            out.setf(std::ios::uppercase);
+            state.flags |= std::ios::uppercase;
             // Falls through
         case 'e':
-            out.setf(std::ios::scientific, std::ios::floatfield);
-            out.setf(std::ios::dec, std::ios::basefield);
+            state.flags = (state.flags & ~(std::ios::floatfield)) | std::ios::scientific;
+            state.flags = (state.flags & ~(std::ios::basefield)) | std::ios::dec;
             break;
         case 'F':
-            out.setf(std::ios::uppercase);
+            state.flags |= std::ios::uppercase;
             // Falls through
         case 'f':
-            out.setf(std::ios::fixed, std::ios::floatfield);
+            state.flags = (state.flags & ~(std::ios::floatfield)) | std::ios::fixed;
             break;
         case 'G':
-            out.setf(std::ios::uppercase);
+            state.flags |= std::ios::uppercase;
             // Falls through
         case 'g':
-            out.setf(std::ios::dec, std::ios::basefield);
+            state.flags = (state.flags & ~(std::ios::basefield)) | std::ios::dec;
             // As in boost::format, let stream decide float format.
-            out.flags(out.flags() & ~std::ios::floatfield);
+            state.flags &= ~std::ios::floatfield;
             break;
         case 'a': case 'A':
             TINYFORMAT_ERROR("tinyformat: the %a and %A conversion specs "
@@ -739,9 +1500,9 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
             break;
         case 's':
             if(precisionSet)
-                ntrunc = static_cast<int>(out.precision());
+                ntrunc = static_cast<int>(state.precision);
             // Make %s print booleans as "true" and "false"
-            out.setf(std::ios::boolalpha);
+            state.flags |= std::ios::boolalpha;
             break;
         case 'n':
             // Not supported - will cause problems!
@@ -754,30 +1515,77 @@ inline const char* streamStateFromFormat(std::ostream& out, bool& spacePadPositi
         default:
             break;
     }
-    if(intConversion && precisionSet && !widthSet)
+    if(intConversion && precisionSet)
     {
         // "precision" for integers gives the minimum number of digits (to be
-        // padded with zeros on the left).  This isn't really supported by the
-        // iostreams, but we can approximately simulate it with the width if
-        // the width isn't otherwise used.
-        out.width(out.precision() + widthExtra);
-        out.setf(std::ios::internal, std::ios::adjustfield);
-        out.fill('0');
+        // padded with zeros on the left).  The iostreams have no equivalent,
+        // so formatImpl() adds the zeros itself.
+        digits = static_cast<int>(state.precision);
+    }
+    if((*c == 's' || *c == 'c' || digits >= 0) && state.fill == '0')
+    {
+        // printf ignores the 0 flag for strings, characters and integers
+        // with a precision
+        state.fill = ' ';
+        state.flags = (state.flags & ~(std::ios::adjustfield)) | std::ios::right;
     }
     return c+1;
 }
 
 
+// Format an integer with at least the given number of digits, after any sign
+// and 0x prefix, then pad it to the stream's width.  Values which don't come
+// out as digits, such as strings passed to %d, are left as they are.
+inline void formatIntegerPrecision(std::ostream& out, const FormatArg& arg,
+                                   const char* fmtBegin, const char* fmtEnd,
+                                   int ntrunc, int digits, bool spacePadPositive)
+{
+    ScratchStream tmp;
+    std::ostream& tmpStream = tmp.stream();
+    tmpStream.copyfmt(out);
+    tmpStream.width(0);
+    if(spacePadPositive)
+        tmpStream.setf(std::ios::showpos);
+    arg.format(tmpStream, fmtBegin, fmtEnd, ntrunc);
+    std::string result(tmp.data(), tmp.size());
+    size_t start = 0;
+    if(start < result.size() && (result[start] == '-' || result[start] == '+'))
+    {
+        if(spacePadPositive && result[start] == '+')
+            result[start] = ' ';
+        ++start;
+    }
+    if(result.size() - start > 2 && result[start] == '0' && (result[start+1] == 'x' || result[start+1] == 'X'))
+        start += 2;
+    bool numeric = start < result.size();
+    for(size_t i = start; numeric && i < result.size(); ++i)
+        numeric = (result[i] >= '0' && result[i] <= '9') || (result[i] >= 'a' && result[i] <= 'f') ||
+                  (result[i] >= 'A' && result[i] <= 'F');
+    if(numeric)
+    {
+        size_t count = result.size() - start;
+        // A zero precision prints zero as nothing, except for "%#.0o"
+        bool octalPrefix = (out.flags() & std::ios::basefield) == std::ios::oct && (out.flags() & std::ios::showbase);
+        if(digits == 0 && count == 1 && result[start] == '0' && !octalPrefix)
+            result.erase(start);
+        else if(count < static_cast<size_t>(digits))
+            result.insert(start, static_cast<size_t>(digits) - count, '0');
+    }
+    writeAligned(out, result.data(), static_cast<std::streamsize>(result.size()));
+}
+
+
 //------------------------------------------------------------------------------
 inline void formatImpl(std::ostream& out, const char* fmt,
                        const detail::FormatArg* formatters,
-                       int numFormatters)
+                       int numFormatters, bool restoreState = true)
 {
     // Saved stream state
-    std::streamsize origWidth = out.width();
-    std::streamsize origPrecision = out.precision();
-    std::ios::fmtflags origFlags = out.flags();
-    char origFill = out.fill();
+    StreamState orig;
+    orig.width = out.width();
+    orig.precision = out.precision();
+    orig.flags = out.flags();
+    orig.fill = out.fill();
 
     for (int argIndex = 0; argIndex < numFormatters; ++argIndex)
     {
@@ -785,8 +1593,13 @@ inline void formatImpl(std::ostream& out, const char* fmt,
         fmt = printFormatStringLiteral(out, fmt);
         bool spacePadPositive = false;
         int ntrunc = -1;
-        const char* fmtEnd = streamStateFromFormat(out, spacePadPositive, ntrunc, fmt,
+        int digits = -1;
+        StreamState state = orig;
+        const char* fmtEnd = streamStateFromFormat(state, spacePadPositive, ntrunc, digits, fmt,
                                                    formatters, argIndex, numFormatters);
+        // On a bad spec, leave the stream as it is
+        if(fmtEnd != fmt)
+            applyStreamState(out, state);
         if (argIndex >= numFormatters)
         {
             // Check args remain after reading any variable width/precision
@@ -795,7 +1608,9 @@ inline void formatImpl(std::ostream& out, const char* fmt,
         }
         const FormatArg& arg = formatters[argIndex];
         // Format the arg into the stream.
-        if(!spacePadPositive)
+        if(digits >= 0)
+            formatIntegerPrecision(out, arg, fmt, fmtEnd, ntrunc, digits, spacePadPositive);
+        else if(!spacePadPositive)
             arg.format(out, fmt, fmtEnd, ntrunc);
         else
         {
@@ -803,14 +1618,21 @@ inline void formatImpl(std::ostream& out, const char* fmt,
             // between stream formatting and the printf() behaviour.  Simulate
             // it crudely by formatting into a temporary string stream and
             // munging the resulting string.
-            std::ostringstream tmpStream;
+            ScratchStream tmp;
+            std::ostream& tmpStream = tmp.stream();
             tmpStream.copyfmt(out);
             tmpStream.setf(std::ios::showpos);
             arg.format(tmpStream, fmt, fmtEnd, ntrunc);
-            std::string result = tmpStream.str(); // allocates... yuck.
-            for(size_t i = 0, iend = result.size(); i < iend; ++i)
-                if(result[i] == '+') result[i] = ' ';
-            out << result;
+            // Only the sign is swapped, after any leading padding; a '+'
+            // further on belongs to the value, as in "1e+10"
+            char* result = tmp.data();
+            size_t sign = 0;
+            while(sign < tmp.size() && result[sign] == tmpStream.fill())
+                ++sign;
+            if(sign < tmp.size() && result[sign] == '+')
+                result[sign] = ' ';
+            // Honour any width the argument's own formatting didn't use up
+            writeAligned(out, result, static_cast<std::streamsize>(tmp.size()));
         }
         fmt = fmtEnd;
     }
@@ -821,10 +1643,8 @@ inline void formatImpl(std::ostream& out, const char* fmt,
         TINYFORMAT_ERROR("tinyformat: Too many conversion specifiers in format string");
 
     // Restore stream state
-    out.width(origWidth);
-    out.precision(origPrecision);
-    out.flags(origFlags);
-    out.fill(origFill);
+    if(restoreState)
+        applyStreamState(out, orig);
 }
 
 } // namespace detail
@@ -844,6 +1664,7 @@ class FormatList
 
         friend void vformat(std::ostream& out, const char* fmt,
                             const FormatList& list);
+        friend class FormatContext;
 
     private:
         const detail::FormatArg* m_formatters;
@@ -944,6 +1765,43 @@ inline void vformat(std::ostream& out, const char* fmt, FormatListRef list)
 }
 
 
+/// Reusable formatting target for repeated formatting into the same buffer.
+///
+/// The context owns an ostream writing to the given streambuf, so the stream
+/// (and its locale setup) is constructed once rather than per call.  Since
+/// nobody else relies on its state, formatting through the context also
+/// skips saving and restoring the stream state around each call; each
+/// conversion only changes the state it needs to.  Intended to be kept per
+/// thread, eg. in a thread_local.
+class FormatContext
+{
+    public:
+        explicit FormatContext(std::streambuf* buf)
+            : m_stream(buf) { }
+
+        std::ostream& stream() { return m_stream; }
+
+        void vformat(const char* fmt, FormatListRef list)
+        {
+            detail::formatImpl(m_stream, fmt, list.m_formatters, list.m_N, false);
+        }
+
+#ifdef TINYFORMAT_USE_VARIADIC_TEMPLATES
+        template<typename... Args>
+        void format(const char* fmt, const Args&... args)
+        {
+            vformat(fmt, makeFormatList(args...));
+        }
+#endif
+
+    private:
+        FormatContext(const FormatContext&);
+        FormatContext& operator=(const FormatContext&);
+
+        std::ostream m_stream;
+};
+
+
 #ifdef TINYFORMAT_USE_VARIADIC_TEMPLATES
 
 /// Format list of arguments to the stream according to given format string.
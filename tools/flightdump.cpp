@@ -0,0 +1,27 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Prints the records kept in a flight recorder file left behind by a crashed process.
+//Build with: c++ -std=c++17 -I.. flightdump.cpp ../FlightRecorder.cpp ../Log.cpp -lpthread
+
+#include "../FlightRecorder.h"
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 2;
+	}
+
+	if (!neosmart::FlightRecorder::Dump(argv[1], 1))
+	{
+		fprintf(stderr, "%s: not a flight recorder file\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Formats random specs and arguments with tinyformat and with snprintf and reports
+//where they differ. The differences tinyformat.h lists as known are not generated.
+//Build once as is and once with -DTINYFORMAT_NO_FAST_PATHS to cover both paths.
+//Build with: c++ -std=c++17 -I.. fmtfuzz.cpp
+
+#define TINYFORMAT_ERROR(reason) ((void) 0)
+#include "../tinyformat.h"
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace std;
+
+static mt19937_64 rng;
+static unsigned long long failures = 0;
+
+//Flags, width and precision; the conversion and any length modifier are added by the caller
+static string Spec()
+{
+	static const char flags[] = "-+ #0";
+	string spec = "%";
+	for (int i = (int)(rng() % 4); i > 0; --i)
+		spec += flags[rng() % 5];
+	switch (rng() % 4)
+	{
+		case 1:
+			spec += to_string(rng() % 25);
+			break;
+		case 2:
+			spec += to_string(rng() % 3);
+			break;
+	}
+	switch (rng() % 4)
+	{
+		case 1:
+			spec += "." + to_string(rng() % 20);
+			break;
+		case 2:
+			spec += ".";
+			break;
+	}
+	return spec;
+}
+
+//printfSpec differs from spec only by the length modifier printf needs for the type
+template<typename T>
+static void Check(const string &spec, const string &printfSpec, const T &value)
+{
+	char expected[512];
+	snprintf(expected, sizeof(expected), printfSpec.c_str(), value);
+	string actual = tfm::format(spec.c_str(), value);
+	if (actual == expected)
+		return;
+
+	if (++failures <= 20)
+		printf("%s: printf \"%s\", tinyformat \"%s\"\n", spec.c_str(), expected, actual.c_str());
+}
+
+template<typename T>
+static void CheckInteger(T value, const char *length)
+{
+	static const char conversions[] = "diuoxX";
+	string spec = Spec();
+	char conversion = conversions[rng() % 6];
+	//%d of an unsigned value prints it unsigned
+	char printfConversion = !is_signed<T>::value && (conversion == 'd' || conversion == 'i') ? 'u' : conversion;
+	Check(spec + conversion, spec + length + printfConversion, value);
+}
+
+static void CheckFloat(double value)
+{
+	static const char conversions[] = "fFeEgG";
+	string spec = Spec() + conversions[rng() % 6];
+	Check(spec, spec, value);
+}
+
+static void CheckString(const char *value)
+{
+	string spec = Spec() + 's';
+	Check(spec, spec, value);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+	rng.seed(argc > 2 ? strtoull(argv[2], nullptr, 10) : 1);
+
+	static const double doubles[] = { 0.0, -0.0, 1.0, -1.5, 0.1, 123456.789, 1e300, -1e-300, 5e-324,
+		INFINITY, -INFINITY, NAN, -NAN, 0.5, 2.5, 1e16, 9.999999, 99.95, DBL_MAX };
+	static const int ints[] = { 0, INT_MIN, INT_MAX, -1, 1, 9, 10, 99, 100 };
+	static const long long longs[] = { 0, LLONG_MIN, LLONG_MAX, -1 };
+
+	for (unsigned long long i = 0; i < count; ++i)
+	{
+		switch (rng() % 12)
+		{
+			case 0:
+				CheckInteger((int) rng(), "");
+				break;
+			case 1:
+				CheckInteger(ints[rng() % (sizeof(ints) / sizeof(ints[0]))], "");
+				break;
+			case 2:
+				CheckInteger((short) rng(), "h");
+				break;
+			case 3:
+				CheckInteger((unsigned) rng(), "");
+				break;
+			case 4:
+				CheckInteger((long long) rng(), "ll");
+				break;
+			case 5:
+				CheckInteger(longs[rng() % (sizeof(longs) / sizeof(longs[0]))], "ll");
+				break;
+			case 6:
+				CheckInteger((unsigned long long) rng(), "ll");
+				break;
+			case 7:
+				CheckFloat(doubles[rng() % (sizeof(doubles) / sizeof(doubles[0]))]);
+				break;
+			case 8:
+			{
+				uint64_t bits = rng();
+				double value;
+				memcpy(&value, &bits, sizeof(value));
+				CheckFloat(value);
+				break;
+			}
+			case 9:
+				CheckFloat(ldexp((double)(int64_t) rng(), (int)(rng() % 80) - 60));
+				break;
+			case 10:
+				CheckFloat((float) doubles[rng() % (sizeof(doubles) / sizeof(doubles[0]))]);
+				break;
+			case 11:
+			{
+				string text(rng() % 30, (char)('a' + rng() % 26));
+				CheckString(rng() % 4 == 0 ? "" : text.c_str());
+				break;
+			}
+		}
+	}
+
+	printf("%llu of %llu cases differ\n", failures, count);
+	return failures != 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Drains every SharedMemorySink ring on the host and writes one merged stream,
+//ordered by record timestamp, to stdout or to the file given with -o.
+//Build with: c++ -std=c++17 -I.. logcollect.cpp ../SharedMemorySink.cpp ../Log.cpp -lpthread -lrt
+
+#include "../SharedMemorySink.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace neosmart;
+using namespace std;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void OnStop(int)
+{
+	stopping = 1;
+}
+
+static uint64_t Now()
+{
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+//Attaches to any rings that appeared since the last scan
+static void Discover(vector<unique_ptr<SharedMemoryReader>> &readers)
+{
+	DIR *directory = opendir("/dev/shm");
+	if (directory == nullptr)
+		return;
+
+	while (dirent *entry = readdir(directory))
+	{
+		if (strncmp(entry->d_name, "nstlog.", 7) != 0)
+			continue;
+
+		string name = string("/") + entry->d_name;
+		bool known = false;
+		for (size_t i = 0; i < readers.size() && !known; ++i)
+			known = readers[i]->Name() == name;
+		if (known)
+			continue;
+
+		unique_ptr<SharedMemoryReader> reader(new SharedMemoryReader(name.c_str()));
+		if (reader->IsOpen())
+			readers.push_back(move(reader));
+	}
+	closedir(directory);
+}
+
+int main(int argc, char *argv[])
+{
+	//Records are held back this long so that a late record from one producer can
+	//still be placed before an earlier-drained record from another.
+	uint64_t window = 50 * 1000000;
+	const char *output = nullptr;
+
+	int option;
+	while ((option = getopt(argc, argv, "w:o:")) != -1)
+	{
+		switch (option)
+		{
+			case 'w':
+				window = strtoull(optarg, nullptr, 10) * 1000000;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-w reorder-window-ms] [-o file]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	ofstream file;
+	if (output != nullptr)
+	{
+		file.open(output, ios::app);
+		if (!file)
+		{
+			fprintf(stderr, "%s: unable to open %s\n", argv[0], output);
+			return 1;
+		}
+	}
+	std::ostream &out = output != nullptr ? file : cout;
+
+	signal(SIGINT, OnStop);
+	signal(SIGTERM, OnStop);
+
+	vector<unique_ptr<SharedMemoryReader>> readers;
+	vector<SharedMemoryReader::Entry> pending;
+	chrono::steady_clock::time_point lastScan;
+
+	while (true)
+	{
+		if (chrono::steady_clock::now() - lastScan > chrono::seconds(1))
+		{
+			Discover(readers);
+			lastScan = chrono::steady_clock::now();
+		}
+
+		size_t drained = 0;
+		for (size_t i = 0; i < readers.size(); )
+		{
+			size_t count = readers[i]->Drain(pending);
+			drained += count;
+
+			//Remove rings whose producer has exited once they are empty
+			if (count == 0 && kill((pid_t) readers[i]->Pid(), 0) != 0 && errno == ESRCH)
+			{
+				shm_unlink(readers[i]->Name().c_str());
+				readers.erase(readers.begin() + i);
+				continue;
+			}
+			++i;
+		}
+
+		stable_sort(pending.begin(), pending.end(),
+			[](const SharedMemoryReader::Entry &a, const SharedMemoryReader::Entry &b) { return a.timestamp < b.timestamp; });
+
+		uint64_t cutoff = stopping ? UINT64_MAX : Now() - window;
+		size_t ready = 0;
+		for (; ready < pending.size() && pending[ready].timestamp <= cutoff; ++ready)
+			out << "[" << pending[ready].pid << "] " << pending[ready].text;
+		pending.erase(pending.begin(), pending.begin() + ready);
+		if (ready != 0)
+			out.flush();
+
+		if (stopping)
+			break;
+		if (drained == 0)
+			usleep(10000);
+	}
+	return 0;
+}
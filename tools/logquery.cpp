@@ -0,0 +1,151 @@
+/*
+ * NeoSmart Logging Library
+ * Author: Mahmoud Al-Qudsi <mqudsi@neosmart.net>
+ * Copyright (C) 2012 by NeoSmart Technologies
+ * This code is released under the terms of the MIT License
+*/
+
+//Searches files written by BinaryLogSink and prints matching records in the usual
+//text layout. Times are seconds since the epoch and may have a fractional part.
+//With -m the records of all files are merged into one time-ordered stream, as for
+//the per-shard files written through a ShardedSink.
+//Build with: c++ -std=c++17 -I.. logquery.cpp ../BinaryLogSink.cpp ../Log.cpp -lpthread
+
+#include "../BinaryLogSink.h"
+#include <algorithm>
+#include <memory>
+#include <unistd.h>
+
+using namespace neosmart;
+using namespace std;
+
+static bool ParseLevel(const char *name, LogLevel &level)
+{
+	static const char *names[] = { "debug", "info", "warn", "error", "passthru" };
+	for (int i = Debug; i <= Passthru; ++i)
+	{
+		if (strcasecmp(name, names[i]) == 0)
+		{
+			level = (LogLevel) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+//Parsed by hand since a double can't hold nanosecond timestamps exactly
+static uint64_t ParseTime(const char *text)
+{
+	char *end;
+	uint64_t time = strtoull(text, &end, 10) * 1000000000;
+	if (*end == '.')
+	{
+		uint64_t scale = 100000000;
+		for (++end; *end >= '0' && *end <= '9' && scale != 0; ++end, scale /= 10)
+			time += (uint64_t)(*end - '0') * scale;
+	}
+	return time;
+}
+
+static void Print(const BinaryLogReader::Entry &entry, bool verbose)
+{
+	if (verbose)
+	{
+		printf("%llu.%09llu [%u", (unsigned long long)(entry.header->timestamp / 1000000000),
+			(unsigned long long)(entry.header->timestamp % 1000000000), entry.header->thread);
+		if (entry.header->cpu != 0)
+			printf(" cpu%u", entry.header->cpu - 1u);
+		printf("] ");
+	}
+	if (verbose && entry.site != nullptr)
+	{
+		//Definitions hold the line, then the file and function
+		uint32_t line;
+		memcpy(&line, entry.site + 1, sizeof(line));
+		const char *file = (const char *)(entry.site + 1) + sizeof(line);
+		printf("%s:%u (%s) ", file, line, file + strlen(file) + 1);
+	}
+	string line = BinaryLogReader::Render(entry);
+	fwrite(line.data(), 1, line.size(), stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	BinaryLogReader::Query query;
+	bool verbose = false;
+	bool merge = false;
+
+	int option;
+	while ((option = getopt(argc, argv, "f:t:l:s:vm")) != -1)
+	{
+		switch (option)
+		{
+			case 'f':
+				query.from = ParseTime(optarg);
+				break;
+			case 't':
+				query.to = ParseTime(optarg);
+				break;
+			case 'l':
+				if (!ParseLevel(optarg, query.level))
+				{
+					fprintf(stderr, "%s: unknown level %s\n", argv[0], optarg);
+					return 2;
+				}
+				break;
+			case 's':
+				query.substring = optarg;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			case 'm':
+				merge = true;
+				break;
+			default:
+				optind = argc + 1;
+				break;
+		}
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Usage: %s [-f from] [-t to] [-l level] [-s substring] [-v] [-m] FILE...\n", argv[0]);
+		return 2;
+	}
+
+	int status = 0;
+	//Entries point into the mapped files, so the readers are kept open until merged
+	vector<unique_ptr<BinaryLogReader>> readers;
+	vector<BinaryLogReader::Entry> merged;
+	for (int i = optind; i < argc; ++i)
+	{
+		unique_ptr<BinaryLogReader> reader(new BinaryLogReader(argv[i]));
+		if (!reader->IsOpen())
+		{
+			fprintf(stderr, "%s: unable to open %s\n", argv[0], argv[i]);
+			status = 1;
+			continue;
+		}
+
+		reader->Search(query, [verbose, merge, &merged](const BinaryLogReader::Entry &entry) {
+			if (merge)
+				merged.push_back(entry);
+			else
+				Print(entry, verbose);
+			return true;
+		});
+		if (merge)
+			readers.push_back(move(reader));
+	}
+
+	//Urgent records may have been written ahead of older ones, so files aren't necessarily in
+	//time order; the sequence numbers keep a thread's records in order when the times tie
+	stable_sort(merged.begin(), merged.end(), [](const BinaryLogReader::Entry &a, const BinaryLogReader::Entry &b) {
+		if (a.header->timestamp != b.header->timestamp)
+			return a.header->timestamp < b.header->timestamp;
+		return a.header->sequence < b.header->sequence;
+	});
+	for (const BinaryLogReader::Entry &entry : merged)
+		Print(entry, verbose);
+	return status;
+}